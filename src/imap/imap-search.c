@@ -580,6 +580,7 @@ bool imap_search_start(struct imap_search_context *ctx,
 		       const enum mail_sort_type *sort_program)
 {
 	struct client_command_context *cmd = ctx->cmd;
+	enum mail_fetch_field wanted_fields = 0;
 
 	imap_search_args_check(ctx, sargs->args);
 
@@ -591,8 +592,11 @@ bool imap_search_start(struct imap_search_context *ctx,
 	ctx->box = cmd->client->mailbox;
 	ctx->trans = mailbox_transaction_begin(ctx->box, 0);
 	ctx->sargs = sargs;
+	if ((ctx->return_options & SEARCH_RETURN_RELEVANCY) != 0)
+		wanted_fields |= MAIL_FETCH_SEARCH_RELEVANCY;
 	ctx->search_ctx =
-		mailbox_search_init(ctx->trans, sargs, sort_program, 0, NULL);
+		mailbox_search_init(ctx->trans, sargs, sort_program,
+				    wanted_fields, NULL);
 	ctx->sorting = sort_program != NULL;
 	(void)gettimeofday(&ctx->start_time, NULL);
 	i_array_init(&ctx->result, 128);
@@ -14,7 +14,9 @@ struct message_search_context {
 	enum message_search_flags flags;
 	normalizer_func_t *normalizer;
 
+	/* only one of these is set */
 	struct str_find_context *str_find_ctx;
+	struct str_find_multi_context *str_find_multi_ctx;
 	struct message_part *prev_part;
 
 	struct message_decoder_context *decoder;
@@ -37,12 +39,30 @@ message_search_init(const char *normalized_key_utf8,
 	return ctx;
 }
 
+struct message_search_context *
+message_search_init_multi(const char *const *normalized_keys_utf8,
+			  normalizer_func_t *normalizer,
+			  enum message_search_flags flags)
+{
+	struct message_search_context *ctx;
+
+	ctx = i_new(struct message_search_context, 1);
+	ctx->flags = flags;
+	ctx->decoder = message_decoder_init(normalizer, 0);
+	ctx->str_find_multi_ctx =
+		str_find_multi_init(default_pool, normalized_keys_utf8);
+	return ctx;
+}
+
 void message_search_deinit(struct message_search_context **_ctx)
 {
 	struct message_search_context *ctx = *_ctx;
 
 	*_ctx = NULL;
-	str_find_deinit(&ctx->str_find_ctx);
+	if (ctx->str_find_ctx != NULL)
+		str_find_deinit(&ctx->str_find_ctx);
+	else
+		str_find_multi_deinit(&ctx->str_find_multi_ctx);
 	message_decoder_deinit(&ctx->decoder);
 	i_free(ctx);
 }
@@ -79,19 +99,25 @@ static void handle_header(struct message_search_context *ctx,
 	}
 }
 
+static bool search_data(struct message_search_context *ctx,
+			const unsigned char *data, size_t size)
+{
+	if (ctx->str_find_ctx != NULL)
+		return str_find_more(ctx->str_find_ctx, data, size);
+	else
+		return str_find_multi_more(ctx->str_find_multi_ctx, data, size);
+}
+
 static bool search_header(struct message_search_context *ctx,
 			  const struct message_header_line *hdr)
 {
 	static const unsigned char crlf[2] = { '\r', '\n' };
 
-	return str_find_more(ctx->str_find_ctx,
-			     (const unsigned char *)hdr->name, hdr->name_len) ||
-		str_find_more(ctx->str_find_ctx,
-			      hdr->middle, hdr->middle_len) ||
-		str_find_more(ctx->str_find_ctx, hdr->full_value,
-			      hdr->full_value_len) ||
-		(!hdr->no_newline &&
-		 str_find_more(ctx->str_find_ctx, crlf, 2));
+	return search_data(ctx, (const unsigned char *)hdr->name,
+			   hdr->name_len) ||
+		search_data(ctx, hdr->middle, hdr->middle_len) ||
+		search_data(ctx, hdr->full_value, hdr->full_value_len) ||
+		(!hdr->no_newline && search_data(ctx, crlf, 2));
 }
 
 static bool message_search_more_decoded2(struct message_search_context *ctx,
@@ -101,12 +127,25 @@ static bool message_search_more_decoded2(struct message_search_context *ctx,
 		if (search_header(ctx, block->hdr))
 			return TRUE;
 	} else {
-		if (str_find_more(ctx->str_find_ctx, block->data, block->size))
+		if (search_data(ctx, block->data, block->size))
 			return TRUE;
 	}
 	return FALSE;
 }
 
+static void message_search_reset_part(struct message_search_context *ctx)
+{
+	/* Content-Type defaults to text/plain */
+	ctx->content_type_text = TRUE;
+
+	ctx->prev_part = NULL;
+	if (ctx->str_find_ctx != NULL)
+		str_find_reset(ctx->str_find_ctx);
+	else
+		str_find_multi_reset(ctx->str_find_multi_ctx);
+	message_decoder_decode_reset(ctx->decoder);
+}
+
 bool message_search_more(struct message_search_context *ctx,
 			 struct message_block *raw_block)
 {
@@ -116,7 +155,7 @@ bool message_search_more(struct message_search_context *ctx,
 	if (raw_block->part != ctx->prev_part) {
 		/* part changes. we must change this before looking at
 		   content type */
-		message_search_reset(ctx);
+		message_search_reset_part(ctx);
 		ctx->prev_part = raw_block->part;
 
 		if (hdr == NULL) {
@@ -160,7 +199,7 @@ bool message_search_more_decoded(struct message_search_context *ctx,
 {
 	if (block->part != ctx->prev_part) {
 		/* part changes */
-		message_search_reset(ctx);
+		message_search_reset_part(ctx);
 		ctx->prev_part = block->part;
 	}
 
@@ -169,12 +208,17 @@ bool message_search_more_decoded(struct message_search_context *ctx,
 
 void message_search_reset(struct message_search_context *ctx)
 {
-	/* Content-Type defaults to text/plain */
-	ctx->content_type_text = TRUE;
+	message_search_reset_part(ctx);
+	if (ctx->str_find_multi_ctx != NULL)
+		str_find_multi_reset_found(ctx->str_find_multi_ctx);
+}
 
-	ctx->prev_part = NULL;
-	str_find_reset(ctx->str_find_ctx);
-	message_decoder_decode_reset(ctx->decoder);
+bool message_search_key_found(struct message_search_context *ctx,
+			      unsigned int key_idx)
+{
+	i_assert(ctx->str_find_multi_ctx != NULL);
+
+	return str_find_multi_key_found(ctx->str_find_multi_ctx, key_idx);
 }
 
 static int
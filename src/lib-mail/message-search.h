@@ -15,6 +15,14 @@ struct message_search_context *
 message_search_init(const char *normalized_key_utf8,
 		    normalizer_func_t *normalizer,
 		    enum message_search_flags flags);
+/* Search for all the NULL-terminated keys in one pass over the message.
+   The search functions return TRUE/1 once all of the keys have been found.
+   The found keys are remembered until message_search_reset(), which is also
+   called by message_search_msg(). */
+struct message_search_context *
+message_search_init_multi(const char *const *normalized_keys_utf8,
+			  normalizer_func_t *normalizer,
+			  enum message_search_flags flags);
 void message_search_deinit(struct message_search_context **ctx);
 
 /* Returns TRUE if key is found from input buffer, FALSE if not. */
@@ -24,6 +32,10 @@ bool message_search_more(struct message_search_context *ctx,
 bool message_search_more_decoded(struct message_search_context *ctx,
 				 struct message_block *block);
 void message_search_reset(struct message_search_context *ctx);
+/* Returns TRUE if normalized_keys_utf8[key_idx] given to
+   message_search_init_multi() has been found. */
+bool message_search_key_found(struct message_search_context *ctx,
+			      unsigned int key_idx);
 /* Search a full message. Returns 1 if match was found, 0 if not,
    -1 if error (if stream_error == 0, the parts contained broken data) */
 int message_search_msg(struct message_search_context *ctx,
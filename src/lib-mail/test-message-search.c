@@ -0,0 +1,173 @@
+/* Copyright (c) 2014 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "istream.h"
+#include "charset-utf8.h"
+#include "quoted-printable.h"
+#include "message-header-decode.h"
+#include "message-search.h"
+#include "test-common.h"
+
+void message_header_decode_utf8(const unsigned char *data, size_t size,
+				buffer_t *dest,
+				normalizer_func_t *normalizer ATTR_UNUSED)
+{
+	buffer_append(dest, data, size);
+}
+
+int quoted_printable_decode(const unsigned char *src, size_t src_size,
+			    size_t *src_pos_r, buffer_t *dest)
+{
+	buffer_append(dest, src, src_size);
+	*src_pos_r = src_size;
+	return 0;
+}
+
+int charset_to_utf8_begin(const char *charset ATTR_UNUSED,
+			  normalizer_func_t *normalizer ATTR_UNUSED,
+			  struct charset_translation **t_r)
+{
+	*t_r = NULL;
+	return 0;
+}
+void charset_to_utf8_end(struct charset_translation **t ATTR_UNUSED) { }
+bool charset_is_utf8(const char *charset ATTR_UNUSED) { return TRUE; }
+
+enum charset_result
+charset_to_utf8(struct charset_translation *t ATTR_UNUSED,
+		const unsigned char *src, size_t *src_size, buffer_t *dest)
+{
+	buffer_append(dest, src, *src_size);
+	return CHARSET_RET_OK;
+}
+
+static const char test_msg[] =
+"From: user@example.com\n"
+"Subject: hello world\n"
+"Content-Type: multipart/mixed; boundary=\"foo\"\n"
+"\n"
+"prologue\n"
+"--foo\n"
+"Content-Type: text/plain\n"
+"Content-Transfer-Encoding: base64\n"
+"\n"
+"Zmlyc3QgcGFydA==\n"
+"--foo\n"
+"Content-Type: application/octet-stream\n"
+"\n"
+"binary data\n"
+"--foo\n"
+"\n"
+"second part\n"
+"--foo--\n";
+
+static const char *test_keys[] = {
+	"hello", "first part", "binary", "second", "part\nsecond",
+	"user@", "nonexistent", "hello", NULL
+};
+
+static int
+test_message_search_msg(struct message_search_context *ctx)
+{
+	struct istream *input;
+	int ret;
+
+	input = test_istream_create(test_msg);
+	ret = message_search_msg(ctx, input, NULL);
+	i_stream_unref(&input);
+	return ret;
+}
+
+static void
+test_message_search_flags(enum message_search_flags flags)
+{
+	struct message_search_context *ctx;
+	bool expected[N_ELEMENTS(test_keys)-1];
+	unsigned int i;
+
+	/* the results must be the same as when searching each key
+	   separately */
+	for (i = 0; test_keys[i] != NULL; i++) {
+		ctx = message_search_init(test_keys[i], NULL, flags);
+		expected[i] = test_message_search_msg(ctx) > 0;
+		message_search_deinit(&ctx);
+	}
+
+	ctx = message_search_init_multi(test_keys, NULL, flags);
+	/* nonexistent key */
+	test_assert(test_message_search_msg(ctx) == 0);
+	for (i = 0; test_keys[i] != NULL; i++)
+		test_assert(message_search_key_found(ctx, i) == expected[i]);
+	message_search_deinit(&ctx);
+
+	/* the found keys are forgotten for the next message */
+	ctx = message_search_init_multi(test_keys + 1, NULL, flags);
+	test_assert(test_message_search_msg(ctx) == 0);
+	test_assert(message_search_key_found(ctx, 0));
+	message_search_reset(ctx);
+	test_assert(!message_search_key_found(ctx, 0));
+	message_search_deinit(&ctx);
+}
+
+static void test_message_search_multi(void)
+{
+	static const char *found_keys[] = { "hello", "second part", NULL };
+	struct message_search_context *ctx;
+
+	test_begin("message search multi");
+	test_message_search_flags(0);
+	test_message_search_flags(MESSAGE_SEARCH_FLAG_SKIP_HEADERS);
+
+	ctx = message_search_init_multi(found_keys, NULL, 0);
+	test_assert(test_message_search_msg(ctx) > 0);
+	test_assert(message_search_key_found(ctx, 0));
+	test_assert(message_search_key_found(ctx, 1));
+	message_search_deinit(&ctx);
+
+	ctx = message_search_init_multi(found_keys, NULL,
+					MESSAGE_SEARCH_FLAG_SKIP_HEADERS);
+	test_assert(test_message_search_msg(ctx) == 0);
+	test_assert(!message_search_key_found(ctx, 0));
+	test_assert(message_search_key_found(ctx, 1));
+	message_search_deinit(&ctx);
+	test_end();
+}
+
+static void test_message_search_single(void)
+{
+	static const struct {
+		const char *key;
+		enum message_search_flags flags;
+		int ret;
+	} tests[] = {
+		{ "Subject: hello", 0, 1 },
+		{ "Subject: hello", MESSAGE_SEARCH_FLAG_SKIP_HEADERS, 0 },
+		{ "first part", MESSAGE_SEARCH_FLAG_SKIP_HEADERS, 1 },
+		{ "Zmlyc3Q", 0, 0 },
+		{ "binary", 0, 0 },
+		{ "prologue", 0, 0 },
+		{ "p", MESSAGE_SEARCH_FLAG_SKIP_HEADERS, 1 },
+		{ "q", 0, 0 }
+	};
+	struct message_search_context *ctx;
+	unsigned int i;
+
+	test_begin("message search");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		ctx = message_search_init(tests[i].key, NULL, tests[i].flags);
+		test_assert_idx(test_message_search_msg(ctx) == tests[i].ret, i);
+		message_search_deinit(&ctx);
+	}
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_message_search_single,
+		test_message_search_multi,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -5,6 +5,13 @@
 
 #include <sys/time.h>
 
+/* SEARCH_BODY or SEARCH_TEXT keys that are searched in one pass over
+   the message */
+struct index_search_body_keys {
+	struct message_search_context *search_ctx;
+	ARRAY(struct mail_search_arg *) args;
+};
+
 struct index_search_context {
         struct mail_search_context mail_ctx;
 	struct mail_index_view *view;
@@ -16,9 +23,13 @@ struct index_search_context {
 	struct mailbox_header_lookup_ctx *extra_wanted_headers;
 
 	uint32_t seq1, seq2;
+	/* Bitmap of messages in seq1..seq2 that may match, or NULL if all
+	   of them may. */
+	buffer_t *prepass_bits;
 	struct mail *cur_mail;
 	struct index_mail *cur_imail;
 	struct mail_thread_context *thread_ctx;
+	struct index_search_body_keys body_keys, text_keys;
 
 	ARRAY(struct mail *) mails;
 	unsigned int unused_mail_idx;
@@ -26,7 +37,15 @@ struct index_search_context {
 
 	struct timeval search_start_time, last_notify;
 	struct timeval last_nonblock_timeval;
-	unsigned long long cost, next_time_check_cost;
+	/* estimated microseconds spent on I/O since the last nonblocking
+	   slice ended */
+	double cost, next_time_check_cost;
+	/* transaction stats when cost was last updated */
+	struct mailbox_transaction_stats cost_stats;
+	/* transaction stats and time when the storage's search_cost was
+	   last updated or the current search_next_nonblock() call began */
+	struct mailbox_transaction_stats learn_stats;
+	struct timeval learn_timeval;
 
 	unsigned int failed:1;
 	unsigned int sorted:1;
@@ -25,12 +25,28 @@
 #include <ctype.h>
 
 #define SEARCH_NOTIFY_INTERVAL_SECS 10
-
-#define SEARCH_COST_DENTRY 3ULL
-#define SEARCH_COST_ATTR 1ULL
-#define SEARCH_COST_FILES_READ 25ULL
-#define SEARCH_COST_KBYTE 15ULL
-#define SEARCH_COST_CACHE 1ULL
+/* The multi-key search automaton takes 1 kB of memory per key byte.
+   Keys longer than this in total are searched one by one. */
+#define SEARCH_MULTI_MAX_KEYS_LEN 1024
+
+/* Initial guesses for how many microseconds each operation takes. They're
+   adjusted to the storage's real performance as searches measure it. */
+static const double search_cost_initial_usecs[MAIL_SEARCH_COST_COUNT] = {
+	3, /* MAIL_SEARCH_COST_DENTRY */
+	1, /* MAIL_SEARCH_COST_ATTR */
+	25, /* MAIL_SEARCH_COST_FILES_READ */
+	15, /* MAIL_SEARCH_COST_KBYTE */
+	1 /* MAIL_SEARCH_COST_CACHE */
+};
+/* Weight of each new measurement in the search cost averages */
+#define SEARCH_COST_LEARN_RATE 0.125
+/* Don't let a single measurement change the search costs by more than
+   this factor. A slow measurement may be caused by e.g. the process just
+   not getting scheduled. */
+#define SEARCH_COST_MAX_CHANGE 4.0
+/* Keep the learned costs within this factor of the initial guesses, so
+   a long run of odd measurements can't make them meaningless. */
+#define SEARCH_COST_MAX_DRIFT 1000.0
 
 #define SEARCH_MIN_NONBLOCK_USECS 200000
 #define SEARCH_MAX_NONBLOCK_USECS 250000
@@ -124,7 +140,7 @@ static void search_seqset_arg(struct mail_search_arg *arg,
 }
 
 static int search_arg_match_keywords(struct index_search_context *ctx,
-				     struct mail_search_arg *arg)
+				     struct mail_search_arg *arg, uint32_t seq)
 {
 	ARRAY_TYPE(keyword_indexes) keyword_indexes_arr;
 	const struct mail_keywords *search_kws = arg->value.keywords;
@@ -132,8 +148,7 @@ static int search_arg_match_keywords(struct index_search_context *ctx,
 	unsigned int i, j, count;
 
 	t_array_init(&keyword_indexes_arr, 128);
-	mail_index_lookup_keywords(ctx->view, ctx->mail_ctx.seq,
-				   &keyword_indexes_arr);
+	mail_index_lookup_keywords(ctx->view, seq, &keyword_indexes_arr);
 	keyword_indexes = array_get(&keyword_indexes_arr, &count);
 
 	/* there probably aren't many keywords, so O(n*m) for now */
@@ -162,7 +177,7 @@ index_search_get_pvt(struct index_search_context *ctx, uint32_t uid)
 
 /* Returns >0 = matched, 0 = not matched, -1 = unknown */
 static int search_arg_match_index(struct index_search_context *ctx,
-				  struct mail_search_arg *arg,
+				  struct mail_search_arg *arg, uint32_t seq,
 				  const struct mail_index_record *rec)
 {
 	enum mail_flags flags, pvt_flags_mask;
@@ -195,19 +210,18 @@ static int search_arg_match_index(struct index_search_context *ctx,
 		return (flags & arg->value.flags) == arg->value.flags;
 	case SEARCH_KEYWORDS:
 		T_BEGIN {
-			ret = search_arg_match_keywords(ctx, arg);
+			ret = search_arg_match_keywords(ctx, arg, seq);
 		} T_END;
 		return ret;
 	case SEARCH_MODSEQ: {
 		if (arg->value.flags != 0) {
 			modseq = mail_index_modseq_lookup_flags(ctx->view,
-					arg->value.flags, ctx->mail_ctx.seq);
+					arg->value.flags, seq);
 		} else if (arg->value.keywords != NULL) {
 			modseq = mail_index_modseq_lookup_keywords(ctx->view,
-					arg->value.keywords, ctx->mail_ctx.seq);
+					arg->value.keywords, seq);
 		} else {
-			modseq = mail_index_modseq_lookup(ctx->view,
-						ctx->mail_ctx.seq);
+			modseq = mail_index_modseq_lookup(ctx->view, seq);
 		}
 		return modseq >= arg->value.modseq->modseq;
 	}
@@ -222,7 +236,7 @@ static void search_index_arg(struct mail_search_arg *arg,
 	const struct mail_index_record *rec;
 
 	rec = mail_index_lookup(ctx->view, ctx->mail_ctx.seq);
-	switch (search_arg_match_index(ctx, arg, rec)) {
+	switch (search_arg_match_index(ctx, arg, ctx->mail_ctx.seq, rec)) {
 	case -1:
 		/* unknown */
 		break;
@@ -287,12 +301,38 @@ static void search_mailbox_arg(struct mail_search_arg *arg,
 	}
 }
 
+static int search_arg_match_date(struct mail_search_arg *arg, time_t date,
+				 int tz_offset, bool have_tz_offset)
+{
+	struct tm *tm;
+
+	if ((arg->value.search_flags &
+	     MAIL_SEARCH_ARG_FLAG_USE_TZ) == 0) {
+		if (!have_tz_offset) {
+			tm = localtime(&date);
+			tz_offset = utc_offset(tm, date);
+		}
+		date += tz_offset * 60;
+	}
+
+	switch (arg->type) {
+	case SEARCH_BEFORE:
+		return date < arg->value.time;
+	case SEARCH_ON:
+		return date >= arg->value.time &&
+			date < arg->value.time + 3600*24;
+	case SEARCH_SINCE:
+		return date >= arg->value.time;
+	default:
+		i_unreached();
+	}
+}
+
 /* Returns >0 = matched, 0 = not matched, -1 = unknown */
 static int search_arg_match_cached(struct index_search_context *ctx,
 				   struct mail_search_arg *arg)
 {
 	const char *str;
-	struct tm *tm;
 	uoff_t virtual_size;
 	time_t date;
 	int tz_offset;
@@ -320,27 +360,8 @@ static int search_arg_match_cached(struct index_search_context *ctx,
 			break;
 		}
 
-		if ((arg->value.search_flags &
-		     MAIL_SEARCH_ARG_FLAG_USE_TZ) == 0) {
-			if (!have_tz_offset) {
-				tm = localtime(&date);
-				tz_offset = utc_offset(tm, date);
-			}
-			date += tz_offset * 60;
-		}
-
-		switch (arg->type) {
-		case SEARCH_BEFORE:
-			return date < arg->value.time;
-		case SEARCH_ON:
-			return date >= arg->value.time &&
-				date < arg->value.time + 3600*24;
-		case SEARCH_SINCE:
-			return date >= arg->value.time;
-		default:
-			/* unreachable */
-			break;
-		}
+		return search_arg_match_date(arg, date, tz_offset,
+					     have_tz_offset);
 
 	/* sizes */
 	case SEARCH_SMALLER:
@@ -606,6 +627,29 @@ static void search_header(struct message_header_line *hdr,
 	}
 }
 
+static int search_body_msg(struct search_body_context *ctx,
+			   struct message_search_context *msg_search_ctx)
+{
+	int ret;
+
+	i_stream_seek(ctx->input, 0);
+	ret = message_search_msg(msg_search_ctx, ctx->input, ctx->part);
+	if (ret < 0 && ctx->input->stream_errno == 0) {
+		/* try again without cached parts */
+		mail_set_cache_corrupted(ctx->index_ctx->cur_mail,
+					 MAIL_FETCH_MESSAGE_PARTS);
+
+		i_stream_seek(ctx->input, 0);
+		ret = message_search_msg(msg_search_ctx, ctx->input, NULL);
+		i_assert(ret >= 0 || ctx->input->stream_errno != 0);
+	}
+	if (ctx->input->stream_errno != 0) {
+		mail_storage_set_critical(ctx->index_ctx->box->storage,
+			"read(%s) failed: %m", i_stream_get_name(ctx->input));
+	}
+	return ret;
+}
+
 static void search_body(struct mail_search_arg *arg,
 			struct search_body_context *ctx)
 {
@@ -626,23 +670,41 @@ static void search_body(struct mail_search_arg *arg,
 		return;
 	}
 
-	i_stream_seek(ctx->input, 0);
-	ret = message_search_msg(msg_search_ctx, ctx->input, ctx->part);
-	if (ret < 0 && ctx->input->stream_errno == 0) {
-		/* try again without cached parts */
-		mail_set_cache_corrupted(ctx->index_ctx->cur_mail,
-					 MAIL_FETCH_MESSAGE_PARTS);
+	ret = search_body_msg(ctx, msg_search_ctx);
+	ARG_SET_RESULT(arg, ret);
+}
 
-		i_stream_seek(ctx->input, 0);
-		ret = message_search_msg(msg_search_ctx, ctx->input, NULL);
-		i_assert(ret >= 0 || ctx->input->stream_errno != 0);
+static int search_body_keys(struct index_search_body_keys *keys,
+			    struct search_body_context *ctx)
+{
+	struct mail_search_arg *const *args;
+	unsigned int i, count;
+	int ret;
+
+	if (keys->search_ctx == NULL)
+		return 0;
+
+	args = array_get(&keys->args, &count);
+	for (i = 0; i < count; i++) {
+		if (args[i]->result == -1)
+			break;
 	}
-	if (ctx->input->stream_errno != 0) {
-		mail_storage_set_critical(ctx->index_ctx->box->storage,
-			"read(%s) failed: %m", i_stream_get_name(ctx->input));
+	if (i == count) {
+		/* all of them are already known */
+		return 0;
 	}
 
-	ARG_SET_RESULT(arg, ret);
+	ret = search_body_msg(ctx, keys->search_ctx);
+	if (ret < 0)
+		return -1;
+	for (i = 0; i < count; i++) {
+		if (args[i]->result == -1) {
+			ret = message_search_key_found(keys->search_ctx, i) ?
+				1 : 0;
+			ARG_SET_RESULT(args[i], ret);
+		}
+	}
+	return 0;
 }
 
 static int search_arg_match_text(struct mail_search_arg *args,
@@ -755,6 +817,9 @@ static int search_arg_match_text(struct mail_search_arg *args,
 	body_ctx.input = input;
 	(void)mail_get_parts(ctx->cur_mail, &body_ctx.part);
 
+	if (search_body_keys(&ctx->body_keys, &body_ctx) < 0 ||
+	    search_body_keys(&ctx->text_keys, &body_ctx) < 0)
+		return -1;
 	return mail_search_args_foreach(args, search_body, &body_ctx);
 }
 
@@ -1034,6 +1099,168 @@ static void search_get_seqset(struct index_search_context *ctx,
 	}
 }
 
+static bool search_arg_is_prepass(const struct mail_search_arg *arg)
+{
+	if (arg->match_always || arg->nonmatch_always)
+		return FALSE;
+
+	switch (arg->type) {
+	/* index record */
+	case SEARCH_UIDSET:
+	case SEARCH_INTHREAD:
+	case SEARCH_FLAGS:
+	case SEARCH_KEYWORDS:
+	case SEARCH_MODSEQ:
+	/* fixed size cache fields */
+	case SEARCH_BEFORE:
+	case SEARCH_ON:
+	case SEARCH_SINCE:
+	case SEARCH_SMALLER:
+	case SEARCH_LARGER:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static bool
+search_prepass_get_field(struct index_search_context *ctx, uint32_t seq,
+			 enum index_cache_field field,
+			 void *data, size_t data_size)
+{
+	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(ctx->box);
+	buffer_t buf;
+
+	buffer_create_from_data(&buf, data, data_size);
+	return mail_cache_lookup_field(ctx->mail_ctx.transaction->cache_view,
+				       &buf, seq,
+				       ibox->cache_fields[field].idx) > 0 &&
+		buf.used == data_size;
+}
+
+/* Returns >0 = matched, 0 = not matched, -1 = unknown */
+static int search_arg_match_prepass(struct index_search_context *ctx,
+				    struct mail_search_arg *arg, uint32_t seq,
+				    const struct mail_index_record *rec)
+{
+	struct mail_sent_date sent_date;
+	enum index_cache_field field;
+	uoff_t virtual_size;
+	uint32_t t;
+
+	switch (arg->type) {
+	case SEARCH_BEFORE:
+	case SEARCH_ON:
+	case SEARCH_SINCE:
+		switch (arg->value.date_type) {
+		case MAIL_SEARCH_DATE_TYPE_SENT:
+			if (!search_prepass_get_field(ctx, seq,
+						      MAIL_CACHE_SENT_DATE,
+						      &sent_date,
+						      sizeof(sent_date)) ||
+			    sent_date.time == (uint32_t)-1)
+				return -1;
+			return search_arg_match_date(arg, sent_date.time,
+						     sent_date.timezone, TRUE);
+		case MAIL_SEARCH_DATE_TYPE_RECEIVED:
+			field = MAIL_CACHE_RECEIVED_DATE;
+			break;
+		case MAIL_SEARCH_DATE_TYPE_SAVED:
+			field = MAIL_CACHE_SAVE_DATE;
+			break;
+		default:
+			return -1;
+		}
+		if (!search_prepass_get_field(ctx, seq, field, &t, sizeof(t)))
+			return -1;
+		return search_arg_match_date(arg, t, 0, FALSE);
+	case SEARCH_SMALLER:
+	case SEARCH_LARGER:
+		if (!search_prepass_get_field(ctx, seq,
+					      MAIL_CACHE_VIRTUAL_FULL_SIZE,
+					      &virtual_size,
+					      sizeof(virtual_size)))
+			return -1;
+		if (arg->type == SEARCH_SMALLER)
+			return virtual_size < arg->value.size;
+		else
+			return virtual_size > arg->value.size;
+	default:
+		return search_arg_match_index(ctx, arg, seq, rec);
+	}
+}
+
+static void search_prepass(struct index_search_context *ctx,
+			   struct mail_search_arg *args)
+{
+	const struct mail_index_record *rec;
+	struct mail_search_arg *arg;
+	unsigned char *bits;
+	uint32_t seq, idx;
+	int ret;
+
+	if (ctx->seq1 > ctx->seq2)
+		return;
+	for (arg = args; arg != NULL; arg = arg->next) {
+		if (search_arg_is_prepass(arg))
+			break;
+	}
+	if (arg == NULL)
+		return;
+
+	/* Go through the root level args (which are ANDed) that can be
+	   answered from the index records and the fixed size cache fields
+	   without a mail. The bit for each message that may still match is
+	   set, so the rest can be skipped without even calling
+	   mail_set_seq(). */
+	ctx->prepass_bits = buffer_create_dynamic(default_pool,
+					(ctx->seq2 - ctx->seq1) / 8 + 1);
+	buffer_append_zero(ctx->prepass_bits, (ctx->seq2 - ctx->seq1) / 8 + 1);
+	bits = buffer_get_modifiable_data(ctx->prepass_bits, NULL);
+
+	for (seq = ctx->seq1; seq <= ctx->seq2; seq++) {
+		rec = mail_index_lookup(ctx->view, seq);
+		for (arg = args; arg != NULL; arg = arg->next) {
+			if (!search_arg_is_prepass(arg))
+				continue;
+			ret = search_arg_match_prepass(ctx, arg, seq, rec);
+			if (ret >= 0 && (ret > 0) == arg->match_not)
+				break;
+		}
+		if (arg == NULL) {
+			idx = seq - ctx->seq1;
+			bits[idx / 8] |= 1 << (idx % 8);
+		}
+	}
+}
+
+/* Move seq forward to the next message that wasn't dropped by the
+   pre-pass */
+static void search_prepass_skip(struct index_search_context *ctx,
+				uint32_t *seq)
+{
+	const unsigned char *bits;
+	uint32_t idx, count;
+
+	if (ctx->prepass_bits == NULL ||
+	    *seq < ctx->seq1 || *seq > ctx->seq2)
+		return;
+
+	bits = ctx->prepass_bits->data;
+	count = ctx->seq2 - ctx->seq1 + 1;
+	for (idx = *seq - ctx->seq1; idx < count; ) {
+		if (idx % 8 == 0 && bits[idx / 8] == 0) {
+			/* skip the whole byte */
+			idx += 8;
+		} else if ((bits[idx / 8] & (1 << (idx % 8))) != 0) {
+			break;
+		} else {
+			idx++;
+		}
+	}
+	*seq = ctx->seq1 + I_MIN(idx, count);
+}
+
 static int search_build_subthread(struct mail_thread_iterate_context *iter,
 				  ARRAY_TYPE(seq_range) *uids)
 {
@@ -1145,21 +1372,27 @@ wanted_sort_fields_get(struct mailbox *box,
 	for (i = 0; sort_program[i] != MAIL_SORT_END; i++) {
 		header = NULL;
 
+		/* the primary DATE, ARRIVAL and SIZE keys are stored in the
+		   index, so they're wanted only for the messages that don't
+		   have them yet. see search_more_with_mail(). */
 		switch (sort_program[i] & MAIL_SORT_MASK) {
 		case MAIL_SORT_ARRIVAL:
-			*wanted_fields_r |= MAIL_FETCH_RECEIVED_DATE;
+			if (i > 0)
+				*wanted_fields_r |= MAIL_FETCH_RECEIVED_DATE;
 			break;
 		case MAIL_SORT_CC:
 			header = "Cc";
 			break;
 		case MAIL_SORT_DATE:
-			*wanted_fields_r |= MAIL_FETCH_DATE;
+			if (i > 0)
+				*wanted_fields_r |= MAIL_FETCH_DATE;
 			break;
 		case MAIL_SORT_FROM:
 			header = "From";
 			break;
 		case MAIL_SORT_SIZE:
-			*wanted_fields_r |= MAIL_FETCH_VIRTUAL_SIZE;
+			if (i > 0)
+				*wanted_fields_r |= MAIL_FETCH_VIRTUAL_SIZE;
 			break;
 		case MAIL_SORT_SUBJECT:
 			header = "Subject";
@@ -1184,6 +1417,89 @@ wanted_sort_fields_get(struct mailbox *box,
 	}
 }
 
+static bool search_args_have_body(const struct mail_search_arg *arg)
+{
+	for (; arg != NULL; arg = arg->next) {
+		switch (arg->type) {
+		case SEARCH_OR:
+		case SEARCH_SUB:
+			if (search_args_have_body(arg->value.subargs))
+				return TRUE;
+			break;
+		case SEARCH_BODY:
+		case SEARCH_TEXT:
+			return TRUE;
+		default:
+			break;
+		}
+	}
+	return FALSE;
+}
+
+static void
+search_get_body_keys(struct index_search_context *ctx,
+		     struct mail_search_arg *arg, enum mail_search_arg_type type,
+		     struct index_search_body_keys *body_keys,
+		     ARRAY_TYPE(string) *keys, size_t *total_len)
+{
+	string_t *dtc;
+	char *key;
+
+	for (; arg != NULL; arg = arg->next) {
+		if (arg->type == SEARCH_OR || arg->type == SEARCH_SUB) {
+			search_get_body_keys(ctx, arg->value.subargs, type,
+					     body_keys, keys, total_len);
+			continue;
+		}
+		if (arg->type != type || arg->value.str[0] == '\0')
+			continue;
+
+		dtc = t_str_new(128);
+		if (ctx->mail_ctx.normalizer(arg->value.str,
+					     strlen(arg->value.str), dtc) < 0)
+			i_panic("search key not utf8: %s", arg->value.str);
+		/* keys that normalize to "" are handled by search_body() */
+		if (str_len(dtc) == 0)
+			continue;
+
+		key = str_c_modifiable(dtc);
+		array_append(&body_keys->args, &arg, 1);
+		array_append(keys, &key, 1);
+		*total_len += str_len(dtc);
+	}
+}
+
+static void
+search_init_body_keys(struct index_search_context *ctx,
+		      struct mail_search_arg *args,
+		      enum mail_search_arg_type type,
+		      struct index_search_body_keys *body_keys)
+{
+	ARRAY_TYPE(string) keys;
+	size_t total_len = 0;
+
+	i_array_init(&body_keys->args, 4);
+	T_BEGIN {
+		t_array_init(&keys, 4);
+		search_get_body_keys(ctx, args, type, body_keys, &keys,
+				     &total_len);
+		if (array_count(&keys) > 1 &&
+		    total_len <= SEARCH_MULTI_MAX_KEYS_LEN) {
+			array_append_zero(&keys);
+			body_keys->search_ctx = message_search_init_multi(
+				(const char *const *)array_idx(&keys, 0),
+				ctx->mail_ctx.normalizer,
+				type == SEARCH_BODY ?
+				MESSAGE_SEARCH_FLAG_SKIP_HEADERS : 0);
+		}
+	} T_END;
+	if (body_keys->search_ctx == NULL) {
+		/* a single key or too long keys are searched by
+		   search_body() */
+		array_free(&body_keys->args);
+	}
+}
+
 struct mail_search_context *
 index_storage_search_init(struct mailbox_transaction_context *t,
 			  struct mail_search_args *args,
@@ -1191,8 +1507,10 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 			  enum mail_fetch_field wanted_fields,
 			  struct mailbox_header_lookup_ctx *wanted_headers)
 {
+	const struct mail_storage_settings *set = t->box->storage->set;
 	struct index_search_context *ctx;
 	struct mailbox_status status;
+	unsigned int prefetch_count;
 
 	ctx = i_new(struct index_search_context, 1);
 	ctx->mail_ctx.transaction = t;
@@ -1202,12 +1520,25 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 	ctx->mail_ctx.args = args;
 	ctx->mail_ctx.sort_program = index_sort_program_init(t, sort_program);
 
-	ctx->max_mails = t->box->storage->set->mail_prefetch_count + 1;
+	prefetch_count = set->mail_prefetch_count;
+	if (set->mail_search_prefetch_count > prefetch_count &&
+	    search_args_have_body(args->args)) {
+		/* body searches are usually slowest waiting for disk reads,
+		   so read ahead more of them in parallel */
+		prefetch_count = set->mail_search_prefetch_count;
+	}
+	ctx->max_mails = prefetch_count + 1;
 	if (ctx->max_mails == 0)
 		ctx->max_mails = UINT_MAX;
 	ctx->next_time_check_cost = SEARCH_INITIAL_MAX_COST;
 	if (gettimeofday(&ctx->last_nonblock_timeval, NULL) < 0)
 		i_fatal("gettimeofday() failed: %m");
+	if (ctx->box->storage->search_cost.usecs[0] == 0) {
+		memcpy(ctx->box->storage->search_cost.usecs,
+		       search_cost_initial_usecs,
+		       sizeof(search_cost_initial_usecs));
+	}
+	ctx->cost_stats = t->stats;
 
 	mailbox_get_open_status(t->box, STATUS_MESSAGES, &status);
 	ctx->mail_ctx.progress_max = status.messages;
@@ -1237,6 +1568,11 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 
 	search_get_seqset(ctx, status.messages, args->args);
 	(void)mail_search_args_foreach(args->args, search_init_arg, ctx);
+	search_prepass(ctx, args->args);
+	/* search all the BODY and all the TEXT keys in the same pass over
+	   the message, instead of parsing the message once per key */
+	search_init_body_keys(ctx, args->args, SEARCH_BODY, &ctx->body_keys);
+	search_init_body_keys(ctx, args->args, SEARCH_TEXT, &ctx->text_keys);
 
 	/* Need to reset results for match_always cases */
 	mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
@@ -1255,6 +1591,14 @@ search_arg_deinit(struct mail_search_arg *arg,
 	}
 }
 
+static void search_deinit_body_keys(struct index_search_body_keys *keys)
+{
+	if (keys->search_ctx != NULL)
+		message_search_deinit(&keys->search_ctx);
+	if (array_is_created(&keys->args))
+		array_free(&keys->args);
+}
+
 int index_storage_search_deinit(struct mail_search_context *_ctx)
 {
         struct index_search_context *ctx = (struct index_search_context *)_ctx;
@@ -1266,6 +1610,8 @@ int index_storage_search_deinit(struct mail_search_context *_ctx)
 	mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
 	(void)mail_search_args_foreach(ctx->mail_ctx.args->args,
 				       search_arg_deinit, ctx);
+	search_deinit_body_keys(&ctx->body_keys);
+	search_deinit_body_keys(&ctx->text_keys);
 
 	if (ctx->mail_ctx.wanted_headers != NULL)
 		mailbox_header_lookup_unref(&ctx->mail_ctx.wanted_headers);
@@ -1283,19 +1629,108 @@ int index_storage_search_deinit(struct mail_search_context *_ctx)
 		mail_free(mailp);
 	}
 	array_free(&ctx->mails);
+	if (ctx->prepass_bits != NULL)
+		buffer_free(&ctx->prepass_bits);
 	i_free(ctx);
 	return ret;
 }
 
-static unsigned long long
-search_get_cost(struct mailbox_transaction_context *trans)
+static void
+search_get_cost_counts(const struct mailbox_transaction_stats *old_stats,
+		       const struct mailbox_transaction_stats *new_stats,
+		       double counts_r[MAIL_SEARCH_COST_COUNT])
+{
+	counts_r[MAIL_SEARCH_COST_DENTRY] =
+		(new_stats->open_lookup_count - old_stats->open_lookup_count) +
+		(new_stats->stat_lookup_count - old_stats->stat_lookup_count);
+	counts_r[MAIL_SEARCH_COST_ATTR] =
+		new_stats->fstat_lookup_count - old_stats->fstat_lookup_count;
+	counts_r[MAIL_SEARCH_COST_FILES_READ] =
+		new_stats->files_read_count - old_stats->files_read_count;
+	counts_r[MAIL_SEARCH_COST_KBYTE] =
+		(new_stats->files_read_bytes - old_stats->files_read_bytes) /
+		1024.0;
+	counts_r[MAIL_SEARCH_COST_CACHE] =
+		new_stats->cache_hit_count - old_stats->cache_hit_count;
+}
+
+static double
+search_get_cost(const struct mail_search_cost *cost,
+		const double counts[MAIL_SEARCH_COST_COUNT])
+{
+	double usecs = 0;
+	unsigned int i;
+
+	for (i = 0; i < MAIL_SEARCH_COST_COUNT; i++)
+		usecs += counts[i] * cost->usecs[i];
+	return usecs;
+}
+
+static void search_update_cost(struct index_search_context *ctx)
+{
+	const struct mailbox_transaction_stats *stats =
+		&ctx->mail_ctx.transaction->stats;
+	double counts[MAIL_SEARCH_COST_COUNT];
+
+	search_get_cost_counts(&ctx->cost_stats, stats, counts);
+	ctx->cost += search_get_cost(&ctx->box->storage->search_cost, counts);
+	ctx->cost_stats = *stats;
+}
+
+static void
+search_learn_cost(struct index_search_context *ctx, const struct timeval *now)
+{
+	struct mail_search_cost *cost = &ctx->box->storage->search_cost;
+	const struct mailbox_transaction_stats *stats =
+		&ctx->mail_ctx.transaction->stats;
+	double counts[MAIL_SEARCH_COST_COUNT];
+	double estimate, ratio, share;
+	long long usecs;
+	unsigned int i;
+
+	usecs = timeval_diff_usecs(now, &ctx->learn_timeval);
+	if (usecs >= 0 && usecs < SEARCH_RECALC_MIN_USECS) {
+		/* too short time to measure reliably */
+		return;
+	}
+
+	search_get_cost_counts(&ctx->learn_stats, stats, counts);
+	estimate = search_get_cost(cost, counts);
+	if (usecs > 0 && estimate > 0) {
+		ratio = usecs / estimate;
+		if (ratio > SEARCH_COST_MAX_CHANGE)
+			ratio = SEARCH_COST_MAX_CHANGE;
+		else if (ratio < 1/SEARCH_COST_MAX_CHANGE)
+			ratio = 1/SEARCH_COST_MAX_CHANGE;
+
+		/* We know only the total time spent, so assume that each
+		   operation type took its estimated share of it. The types
+		   that took most of the time learn the fastest, so the
+		   estimates diverge when the mix of operations changes. */
+		for (i = 0; i < MAIL_SEARCH_COST_COUNT; i++) {
+			share = counts[i] * cost->usecs[i] / estimate;
+			cost->usecs[i] += SEARCH_COST_LEARN_RATE * share *
+				(cost->usecs[i] * ratio - cost->usecs[i]);
+			if (cost->usecs[i] > search_cost_initial_usecs[i] *
+			    SEARCH_COST_MAX_DRIFT) {
+				cost->usecs[i] = search_cost_initial_usecs[i] *
+					SEARCH_COST_MAX_DRIFT;
+			} else if (cost->usecs[i] < search_cost_initial_usecs[i] /
+				   SEARCH_COST_MAX_DRIFT) {
+				cost->usecs[i] = search_cost_initial_usecs[i] /
+					SEARCH_COST_MAX_DRIFT;
+			}
+		}
+	}
+	ctx->learn_stats = *stats;
+	ctx->learn_timeval = *now;
+}
+
+static void search_learn_reset(struct index_search_context *ctx)
 {
-	return trans->stats.open_lookup_count * SEARCH_COST_DENTRY +
-		trans->stats.stat_lookup_count * SEARCH_COST_DENTRY +
-		trans->stats.fstat_lookup_count * SEARCH_COST_ATTR +
-		trans->stats.cache_hit_count * SEARCH_COST_CACHE +
-		trans->stats.files_read_count * SEARCH_COST_FILES_READ +
-		(trans->stats.files_read_bytes/1024) * SEARCH_COST_KBYTE;
+	if (gettimeofday(&ctx->learn_timeval, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	ctx->learn_stats = ctx->mail_ctx.transaction->stats;
 }
 
 static int search_match_once(struct index_search_context *ctx)
@@ -1452,7 +1887,7 @@ static void index_storage_search_notify(struct mailbox *box,
 static bool search_would_block(struct index_search_context *ctx)
 {
 	struct timeval now;
-	unsigned long long guess_cost;
+	double guess_cost;
 	long long usecs;
 	bool ret;
 
@@ -1461,6 +1896,7 @@ static bool search_would_block(struct index_search_context *ctx)
 
 	if (gettimeofday(&now, NULL) < 0)
 		i_fatal("gettimeofday() failed: %m");
+	search_learn_cost(ctx, &now);
 
 	usecs = timeval_diff_usecs(&now, &ctx->last_nonblock_timeval);
 	if (usecs < 0) {
@@ -1500,7 +1936,7 @@ static int search_more_with_mail(struct index_search_context *ctx,
 	struct mail_search_context *_ctx = &ctx->mail_ctx;
 	struct mailbox *box = _ctx->transaction->box;
 	struct index_mail *imail = (struct index_mail *)mail;
-	unsigned long long cost1, cost2;
+	enum mail_fetch_field sort_fields;
 	int match, ret;
 
 	if (search_would_block(ctx)) {
@@ -1515,10 +1951,17 @@ static int search_more_with_mail(struct index_search_context *ctx,
 
 	mail_search_args_reset(_ctx->args->args, FALSE);
 
-	cost1 = search_get_cost(mail->transaction);
 	ret = -1;
 	while (box->v.search_next_update_seq(_ctx)) {
 		mail_set_seq(mail, _ctx->seq);
+		if (_ctx->sort_program != NULL) {
+			sort_fields = index_sort_get_missing_key_fields(
+					_ctx->sort_program, _ctx->seq);
+			if (sort_fields != 0) {
+				mail_add_temp_wanted_fields(mail, sort_fields,
+							    NULL);
+			}
+		}
 
 		ctx->cur_mail = mail;
 		T_BEGIN {
@@ -1543,17 +1986,13 @@ static int search_more_with_mail(struct index_search_context *ctx,
 			break;
 		}
 
-		cost2 = search_get_cost(mail->transaction);
-		ctx->cost += cost2 - cost1;
-		cost1 = cost2;
-
+		search_update_cost(ctx);
 		if (search_would_block(ctx)) {
 			ret = 0;
 			break;
 		}
 	}
-	cost2 = search_get_cost(mail->transaction);
-	ctx->cost += cost2 - cost1;
+	search_update_cost(ctx);
 	return ret;
 }
 
@@ -1684,6 +2123,10 @@ bool index_storage_search_next_nonblock(struct mail_search_context *_ctx,
 
 	*tryagain_r = FALSE;
 
+	/* learn only from the time spent in this call. The caller may do
+	   anything between the calls, e.g. wait for the client. */
+	search_learn_reset(ctx);
+
 	if (_ctx->sort_program == NULL) {
 		ret = search_more(ctx, &mail);
 		if (ret == 0) {
@@ -1735,6 +2178,7 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 	} else {
 		_ctx->seq++;
 	}
+	search_prepass_skip(ctx, &_ctx->seq);
 
 	if (!ctx->have_seqsets && !ctx->have_index_args &&
 	    _ctx->update_result == NULL) {
@@ -1765,6 +2209,7 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 
 		/* doesn't, try next one */
 		_ctx->seq++;
+		search_prepass_skip(ctx, &_ctx->seq);
 		mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
 	}
 
@@ -12,6 +12,11 @@ struct mail_search_sort_program {
 			      struct mail *mail);
 	void (*sort_list_finish)(struct mail_search_sort_program *program);
 	void *context;
+	/* DATE, ARRIVAL and SIZE sorts: index extension with the primary
+	   sort key of each message. A key value of 0 means it's not stored
+	   yet, and then key_fetch_field is needed to look it up. */
+	uint32_t key_ext_id;
+	enum mail_fetch_field key_fetch_field;
 
 	ARRAY_TYPE(uint32_t) seqs;
 	unsigned int iter_idx;
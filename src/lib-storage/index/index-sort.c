@@ -30,6 +30,13 @@ struct mail_sort_node_float {
 };
 ARRAY_DEFINE_TYPE(mail_sort_node_float, struct mail_sort_node_float);
 
+/* Sort keys stored to the index extensions. 0 means that the key isn't
+   stored yet, so shift the values to make them practically never 0. */
+#define SORT_DATE_TO_KEY(date) ((uint64_t)(int64_t)(date) ^ (1ULL << 63))
+#define SORT_KEY_TO_DATE(key) ((time_t)(int64_t)((key) ^ (1ULL << 63)))
+#define SORT_SIZE_TO_KEY(size) ((uint64_t)(size) + 1)
+#define SORT_KEY_TO_SIZE(key) ((uoff_t)((key) - 1))
+
 struct sort_cmp_context {
 	struct mail_search_sort_program *program;
 	struct mail *mail;
@@ -38,17 +45,46 @@ struct sort_cmp_context {
 
 static struct sort_cmp_context static_node_cmp_context;
 
+static uint64_t
+index_sort_lookup_key(struct mail_search_sort_program *program, uint32_t seq)
+{
+	const void *data;
+	bool expunged;
+
+	mail_index_lookup_ext(program->t->view, seq, program->key_ext_id,
+			      &data, &expunged);
+	return data == NULL ? 0 : *(const uint64_t *)data;
+}
+
+static void
+index_sort_update_key(struct mail_search_sort_program *program, uint32_t seq,
+		      uint64_t key)
+{
+	/* the keys never change for a message, so they can be added to the
+	   index once and used by all the later sorts */
+	mail_index_update_ext(program->t->itrans, seq, program->key_ext_id,
+			      &key, NULL);
+}
+
 static void
 index_sort_list_add_arrival(struct mail_search_sort_program *program,
 			    struct mail *mail)
 {
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
 	struct mail_sort_node_date *node;
+	uint64_t key;
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_received_date(mail, &node->date) < 0)
+	key = index_sort_lookup_key(program, mail->seq);
+	if (key != 0)
+		node->date = SORT_KEY_TO_DATE(key);
+	else if (mail_get_received_date(mail, &node->date) < 0)
 		node->date = 0;
+	else {
+		index_sort_update_key(program, mail->seq,
+				      SORT_DATE_TO_KEY(node->date));
+	}
 }
 
 static void
@@ -57,15 +93,25 @@ index_sort_list_add_date(struct mail_search_sort_program *program,
 {
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
 	struct mail_sort_node_date *node;
+	uint64_t key;
 	int tz;
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
+	key = index_sort_lookup_key(program, mail->seq);
+	if (key != 0) {
+		node->date = SORT_KEY_TO_DATE(key);
+		return;
+	}
+
 	if (mail_get_date(mail, &node->date, &tz) < 0)
 		node->date = 0;
-	else if (node->date == 0) {
-		if (mail_get_received_date(mail, &node->date) < 0)
-			node->date = 0;
+	else if (node->date == 0 &&
+		 mail_get_received_date(mail, &node->date) < 0)
+		node->date = 0;
+	else {
+		index_sort_update_key(program, mail->seq,
+				      SORT_DATE_TO_KEY(node->date));
 	}
 }
 
@@ -75,11 +121,19 @@ index_sort_list_add_size(struct mail_search_sort_program *program,
 {
 	ARRAY_TYPE(mail_sort_node_size) *nodes = program->context;
 	struct mail_sort_node_size *node;
+	uint64_t key;
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_virtual_size(mail, &node->size) < 0)
+	key = index_sort_lookup_key(program, mail->seq);
+	if (key != 0)
+		node->size = SORT_KEY_TO_SIZE(key);
+	else if (mail_get_virtual_size(mail, &node->size) < 0)
 		node->size = 0;
+	else {
+		index_sort_update_key(program, mail->seq,
+				      SORT_SIZE_TO_KEY(node->size));
+	}
 }
 
 static uoff_t index_sort_get_pop3_order(struct mail *mail)
@@ -245,6 +299,26 @@ bool index_sort_list_next(struct mail_search_sort_program *program,
 	return TRUE;
 }
 
+enum mail_fetch_field
+index_sort_get_missing_key_fields(struct mail_search_sort_program *program,
+				  uint32_t seq)
+{
+	if (program->key_fetch_field == 0 ||
+	    index_sort_lookup_key(program, seq) != 0)
+		return 0;
+	return program->key_fetch_field;
+}
+
+static void
+index_sort_register_key_ext(struct mail_search_sort_program *program,
+			    const char *name, enum mail_fetch_field field)
+{
+	program->key_ext_id =
+		mail_index_ext_register(program->t->box->index, name, 0,
+					sizeof(uint64_t), sizeof(uint64_t));
+	program->key_fetch_field = field;
+}
+
 struct mail_search_sort_program *
 index_sort_program_init(struct mailbox_transaction_context *t,
 			const enum mail_sort_type *sort_program)
@@ -277,10 +351,15 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 		i_array_init(nodes, 128);
 
 		if ((program->sort_program[0] &
-		     MAIL_SORT_MASK) == MAIL_SORT_ARRIVAL)
+		     MAIL_SORT_MASK) == MAIL_SORT_ARRIVAL) {
 			program->sort_list_add = index_sort_list_add_arrival;
-		else
+			index_sort_register_key_ext(program, "sort-arrival",
+						    MAIL_FETCH_RECEIVED_DATE);
+		} else {
 			program->sort_list_add = index_sort_list_add_date;
+			index_sort_register_key_ext(program, "sort-date",
+						    MAIL_FETCH_DATE);
+		}
 		program->sort_list_finish = index_sort_list_finish_date;
 		program->context = nodes;
 		break;
@@ -290,6 +369,8 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 
 		nodes = i_malloc(sizeof(*nodes));
 		i_array_init(nodes, 128);
+		index_sort_register_key_ext(program, "sort-size",
+					    MAIL_FETCH_VIRTUAL_SIZE);
 		program->sort_list_add = index_sort_list_add_size;
 		program->sort_list_finish = index_sort_list_finish_size;
 		program->context = nodes;
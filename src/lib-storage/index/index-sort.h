@@ -15,4 +15,10 @@ void index_sort_list_finish(struct mail_search_sort_program *program);
 bool index_sort_list_next(struct mail_search_sort_program *program,
 			  uint32_t *seq_r);
 
+/* Returns the fields needed for sorting the message whose primary sort key
+   isn't stored in the index yet, or 0 if nothing needs to be looked up. */
+enum mail_fetch_field
+index_sort_get_missing_key_fields(struct mail_search_sort_program *program,
+				  uint32_t seq);
+
 #endif
@@ -1087,6 +1087,11 @@ uint32_t maildir_uidlist_get_next_uid(struct maildir_uidlist *uidlist)
 	return !uidlist->initial_hdr_read ? 0 : uidlist->next_uid;
 }
 
+unsigned int maildir_uidlist_get_change_counter(struct maildir_uidlist *uidlist)
+{
+	return uidlist->change_counter;
+}
+
 int maildir_uidlist_get_mailbox_guid(struct maildir_uidlist *uidlist,
 				     guid_128_t mailbox_guid)
 {
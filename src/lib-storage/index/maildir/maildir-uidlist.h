@@ -89,6 +89,9 @@ maildir_uidlist_lookup_ext(struct maildir_uidlist *uidlist, uint32_t uid,
 
 uint32_t maildir_uidlist_get_uid_validity(struct maildir_uidlist *uidlist);
 uint32_t maildir_uidlist_get_next_uid(struct maildir_uidlist *uidlist);
+/* Returns a counter that is increased whenever the records in memory change.
+   This can be used to find out if data derived from them is still valid. */
+unsigned int maildir_uidlist_get_change_counter(struct maildir_uidlist *uidlist);
 int maildir_uidlist_get_mailbox_guid(struct maildir_uidlist *uidlist,
 				     guid_128_t mailbox_guid);
 void maildir_uidlist_set_mailbox_guid(struct maildir_uidlist *uidlist,
@@ -91,6 +91,23 @@ struct mail_binary_cache {
 	uoff_t size;
 };
 
+enum mail_search_cost_type {
+	MAIL_SEARCH_COST_DENTRY = 0,
+	MAIL_SEARCH_COST_ATTR,
+	MAIL_SEARCH_COST_FILES_READ,
+	MAIL_SEARCH_COST_KBYTE,
+	MAIL_SEARCH_COST_CACHE,
+
+	MAIL_SEARCH_COST_COUNT
+};
+
+struct mail_search_cost {
+	/* Estimated microseconds that each mail_search_cost_type operation
+	   takes in this storage, learned from the searches' timings.
+	   0 = not initialized yet. */
+	double usecs[MAIL_SEARCH_COST_COUNT];
+};
+
 struct mail_storage_error {
 	char *error_string;
 	enum mail_error error;
@@ -130,6 +147,7 @@ struct mail_storage {
 	void *callback_context;
 
 	struct mail_binary_cache binary_cache;
+	struct mail_search_cost search_cost;
 	/* Filled lazily by mailbox_attribute_*() when accessing shared
 	   attributes. */
 	struct dict *_shared_attr_dict;
@@ -32,6 +32,7 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(SET_SIZE, mail_attachment_min_size),
 	DEF(SET_STR_VARS, mail_attribute_dict),
 	DEF(SET_UINT, mail_prefetch_count),
+	DEF(SET_UINT, mail_search_prefetch_count),
 	DEF(SET_STR, mail_cache_fields),
 	DEF(SET_STR, mail_always_cache_fields),
 	DEF(SET_STR, mail_never_cache_fields),
@@ -70,6 +71,7 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_attachment_min_size = 1024*128,
 	.mail_attribute_dict = "",
 	.mail_prefetch_count = 0,
+	.mail_search_prefetch_count = 0,
 	.mail_cache_fields = "flags",
 	.mail_always_cache_fields = "",
 	.mail_never_cache_fields = "imap.envelope",
@@ -17,6 +17,7 @@ struct mail_storage_settings {
 	uoff_t mail_attachment_min_size;
 	const char *mail_attribute_dict;
 	unsigned int mail_prefetch_count;
+	unsigned int mail_search_prefetch_count;
 	const char *mail_cache_fields;
 	const char *mail_always_cache_fields;
 	const char *mail_never_cache_fields;
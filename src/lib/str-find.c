@@ -19,6 +19,27 @@ struct str_find_context {
 	int goodtab[FLEXIBLE_ARRAY_MEMBER];
 };
 
+/* Aho-Corasick automaton. State 0 is the root. */
+struct str_find_multi_context {
+	pool_t pool;
+	unsigned int key_count, state_count;
+	unsigned int terminal_count, found_count;
+
+	/* next[state * 256 + c] = the state after reading c in state */
+	unsigned int *next;
+	/* The closest state in the failure chain that ends a key,
+	   0 if none */
+	unsigned int *dict_link;
+	/* key_states[key_idx] = the state that ends the key */
+	unsigned int *key_states;
+	/* state_flags[state] = STATE_FLAG_* */
+	uint8_t *state_flags;
+
+	unsigned int state;
+};
+#define STATE_FLAG_TERMINAL	0x01
+#define STATE_FLAG_FOUND	0x02
+
 static void init_badtab(struct str_find_context *ctx)
 {
 	unsigned int i, len_1 = ctx->key_len - 1;
@@ -142,6 +163,17 @@ bool str_find_more(struct str_find_context *ctx,
 	} else {
 		/* Boyer-Moore searching */
 		j = 0;
+		if (key_len == 1) {
+			/* the libc memchr() is usually much faster than
+			   anything we could do here */
+			const unsigned char *p = memchr(data, ctx->key[0], size);
+
+			if (p != NULL) {
+				ctx->match_end_pos = p - data + 1;
+				return TRUE;
+			}
+			j = size;
+		}
 		while (j + key_len <= size) {
 			i = key_len - 1;
 			while (ctx->key[i] == data[i + j]) {
@@ -180,3 +212,161 @@ void str_find_reset(struct str_find_context *ctx)
 {
 	ctx->match_count = 0;
 }
+
+struct str_find_multi_context *
+str_find_multi_init(pool_t pool, const char *const *keys)
+{
+	struct str_find_multi_context *ctx;
+	unsigned int *fail, *queue;
+	unsigned int i, j, c, key_len, state, max_states = 1;
+	unsigned int queue_first, queue_last, s, t;
+
+	ctx = p_new(pool, struct str_find_multi_context, 1);
+	ctx->pool = pool;
+	ctx->key_count = str_array_length(keys);
+	i_assert(ctx->key_count > 0);
+	for (i = 0; i < ctx->key_count; i++) {
+		i_assert(keys[i][0] != '\0');
+		max_states += strlen(keys[i]);
+	}
+
+	ctx->next = p_new(pool, unsigned int, max_states * (UCHAR_MAX+1));
+	ctx->dict_link = p_new(pool, unsigned int, max_states);
+	ctx->key_states = p_new(pool, unsigned int, ctx->key_count);
+	ctx->state_flags = p_new(pool, uint8_t, max_states);
+
+	/* build the trie. 0 is used for missing transitions, since nothing
+	   goes back to the root. */
+	ctx->state_count = 1;
+	for (i = 0; i < ctx->key_count; i++) {
+		const unsigned char *key = (const unsigned char *)keys[i];
+
+		key_len = strlen(keys[i]);
+		for (j = 0, state = 0; j < key_len; j++) {
+			unsigned int *nextp =
+				&ctx->next[state * (UCHAR_MAX+1) + key[j]];
+
+			if (*nextp == 0)
+				*nextp = ctx->state_count++;
+			state = *nextp;
+		}
+		/* the same key may be given multiple times */
+		if ((ctx->state_flags[state] & STATE_FLAG_TERMINAL) == 0) {
+			ctx->state_flags[state] |= STATE_FLAG_TERMINAL;
+			ctx->terminal_count++;
+		}
+		ctx->key_states[i] = state;
+	}
+
+	/* add the failure transitions breadth-first, so the automaton never
+	   needs to backtrack */
+	T_BEGIN {
+		fail = t_new(unsigned int, ctx->state_count);
+		queue = t_new(unsigned int, ctx->state_count);
+		queue_first = queue_last = 0;
+		for (c = 0; c <= UCHAR_MAX; c++) {
+			t = ctx->next[c];
+			if (t != 0)
+				queue[queue_last++] = t;
+		}
+		while (queue_first < queue_last) {
+			s = queue[queue_first++];
+			for (c = 0; c <= UCHAR_MAX; c++) {
+				unsigned int *nextp =
+					&ctx->next[s * (UCHAR_MAX+1) + c];
+				unsigned int fail_next =
+					ctx->next[fail[s] * (UCHAR_MAX+1) + c];
+
+				if (*nextp == 0) {
+					*nextp = fail_next;
+					continue;
+				}
+				t = *nextp;
+				fail[t] = fail_next;
+				ctx->dict_link[t] =
+					(ctx->state_flags[fail_next] &
+					 STATE_FLAG_TERMINAL) != 0 ? fail_next :
+					ctx->dict_link[fail_next];
+				queue[queue_last++] = t;
+			}
+		}
+	} T_END;
+	return ctx;
+}
+
+void str_find_multi_deinit(struct str_find_multi_context **_ctx)
+{
+	struct str_find_multi_context *ctx = *_ctx;
+
+	*_ctx = NULL;
+	p_free(ctx->pool, ctx->next);
+	p_free(ctx->pool, ctx->dict_link);
+	p_free(ctx->pool, ctx->key_states);
+	p_free(ctx->pool, ctx->state_flags);
+	p_free(ctx->pool, ctx);
+}
+
+static void
+str_find_multi_set_found(struct str_find_multi_context *ctx,
+			 unsigned int state)
+{
+	if ((ctx->state_flags[state] & STATE_FLAG_TERMINAL) == 0)
+		state = ctx->dict_link[state];
+
+	/* the keys in the rest of the chain are suffixes of this one, so
+	   they've already been marked found if this one has been */
+	while (state != 0 &&
+	       (ctx->state_flags[state] & STATE_FLAG_FOUND) == 0) {
+		ctx->state_flags[state] |= STATE_FLAG_FOUND;
+		ctx->found_count++;
+		state = ctx->dict_link[state];
+	}
+}
+
+bool str_find_multi_more(struct str_find_multi_context *ctx,
+			 const unsigned char *data, size_t size)
+{
+	const unsigned int *next = ctx->next;
+	const unsigned int *dict_link = ctx->dict_link;
+	const uint8_t *state_flags = ctx->state_flags;
+	unsigned int state = ctx->state;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		state = next[state * (UCHAR_MAX+1) + data[i]];
+		if (((state_flags[state] & STATE_FLAG_TERMINAL) != 0 ||
+		     dict_link[state] != 0) &&
+		    (state_flags[state] & STATE_FLAG_FOUND) == 0) {
+			str_find_multi_set_found(ctx, state);
+			if (ctx->found_count == ctx->terminal_count) {
+				ctx->state = state;
+				return TRUE;
+			}
+		}
+	}
+	ctx->state = state;
+	return FALSE;
+}
+
+bool str_find_multi_key_found(struct str_find_multi_context *ctx,
+			      unsigned int key_idx)
+{
+	i_assert(key_idx < ctx->key_count);
+
+	return (ctx->state_flags[ctx->key_states[key_idx]] &
+		STATE_FLAG_FOUND) != 0;
+}
+
+void str_find_multi_reset(struct str_find_multi_context *ctx)
+{
+	ctx->state = 0;
+}
+
+void str_find_multi_reset_found(struct str_find_multi_context *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->state_count; i++)
+		ctx->state_flags[i] &= ~STATE_FLAG_FOUND;
+	ctx->found_count = 0;
+}
@@ -2,6 +2,7 @@
 #define STR_FIND_H
 
 struct str_find_context;
+struct str_find_multi_context;
 
 struct str_find_context *str_find_init(pool_t pool, const char *key);
 void str_find_deinit(struct str_find_context **ctx);
@@ -17,4 +18,24 @@ size_t str_find_get_match_end_pos(struct str_find_context *ctx);
    to earlier data. */
 void str_find_reset(struct str_find_context *ctx);
 
+/* Find multiple keys from the same data in one pass. keys is a
+   NULL-terminated array of non-empty strings. The lookup table takes
+   1 kB of memory for each byte in the keys, so the caller should limit
+   their total length. */
+struct str_find_multi_context *
+str_find_multi_init(pool_t pool, const char *const *keys);
+void str_find_multi_deinit(struct str_find_multi_context **ctx);
+
+/* Returns TRUE once all the keys have been found. The data can be sent in
+   arbitrary blocks like with str_find_more(). */
+bool str_find_multi_more(struct str_find_multi_context *ctx,
+			 const unsigned char *data, size_t size);
+/* Returns TRUE if keys[key_idx] has been found. */
+bool str_find_multi_key_found(struct str_find_multi_context *ctx,
+			      unsigned int key_idx);
+/* Reset input data, but remember the keys that have already been found. */
+void str_find_multi_reset(struct str_find_multi_context *ctx);
+/* Forget the keys that have been found. */
+void str_find_multi_reset_found(struct str_find_multi_context *ctx);
+
 #endif
@@ -56,6 +56,66 @@ struct str_find_input {
 	int pos;
 };
 
+static void test_str_find_multi(void)
+{
+	static const char *keys[] = {
+		"abc", "xab", "b", "bab", "ababc", "abd", "abc", "cdx", "d",
+		"xababcd", "xababcde", NULL
+	};
+	const unsigned char *text = (const unsigned char *)str_find_text;
+	const unsigned int text_len = strlen(str_find_text);
+	struct str_find_multi_context *ctx;
+	unsigned int i, j, pos, max;
+	bool all_found, success = TRUE;
+
+	ctx = str_find_multi_init(default_pool, keys);
+	/* divide text into every possible block combination */
+	max = 1U << (text_len-1);
+	for (i = 0; i < max && success; i++) {
+		str_find_multi_reset(ctx);
+		str_find_multi_reset_found(ctx);
+		pos = 0; all_found = FALSE;
+		for (j = 0; j < text_len; j++) {
+			if ((i & (1 << j)) != 0 || j == text_len-1) {
+				if (str_find_multi_more(ctx, text+pos,
+							j-pos+1))
+					all_found = TRUE;
+				pos = j + 1;
+			}
+		}
+		if (all_found)
+			success = FALSE;
+		for (j = 0; keys[j] != NULL; j++) {
+			if (str_find_multi_key_found(ctx, j) !=
+			    (strstr(str_find_text, keys[j]) != NULL))
+				success = FALSE;
+		}
+	}
+
+	/* the found keys are remembered after reset, but the input isn't */
+	str_find_multi_reset(ctx);
+	str_find_multi_reset_found(ctx);
+	test_assert(!str_find_multi_more(ctx, text, 3));
+	str_find_multi_reset(ctx);
+	test_assert(!str_find_multi_more(ctx, text+3, 4));
+	test_assert(str_find_multi_key_found(ctx, 0));
+	test_assert(str_find_multi_key_found(ctx, 1));
+	test_assert(!str_find_multi_key_found(ctx, 4));
+	test_assert(!str_find_multi_key_found(ctx, 9));
+	str_find_multi_deinit(&ctx);
+
+	/* finding all the keys */
+	ctx = str_find_multi_init(default_pool, keys + 7);
+	success = success &&
+		!str_find_multi_more(ctx, (const unsigned char *)"abcdx", 5) &&
+		str_find_multi_key_found(ctx, 0) &&
+		!str_find_multi_key_found(ctx, 2);
+	success = success &&
+		str_find_multi_more(ctx, (const unsigned char *)"xababcde", 8);
+	str_find_multi_deinit(&ctx);
+	test_out("str_find_multi()", success);
+}
+
 void test_str_find(void)
 {
 	static const char *fail_input[] = {
@@ -83,4 +143,6 @@ void test_str_find(void)
 	for (i = 0; i < N_ELEMENTS(fail_input) && success; i++)
 		success = test_str_find_substring(fail_input[i], -1);
 	test_out("str_find()", success);
+
+	test_str_find_multi();
 }
@@ -454,7 +454,7 @@ fts_backend_lucene_refresh(struct fts_backend *_backend)
 		(struct lucene_fts_backend *)_backend;
 
 	if (backend->index != NULL)
-		lucene_index_close(backend->index);
+		lucene_index_refresh(backend->index);
 	return 0;
 }
 
@@ -34,6 +34,31 @@ fts_lucene_plugin_init_settings(struct mail_user *user,
 			set->no_snowball = TRUE;
 		} else if (strcmp(*tmp, "mime_parts") == 0) {
 			set->mime_parts = TRUE;
+		} else if (strncmp(*tmp, "ram_buffer_mb=", 14) == 0) {
+			if (str_to_uint(*tmp + 14, &set->ram_buffer_mb) < 0) {
+				i_error("fts_lucene: Invalid ram_buffer_mb: %s",
+					*tmp + 14);
+				return -1;
+			}
+		} else if (strncmp(*tmp, "merge_factor=", 13) == 0) {
+			if (str_to_uint(*tmp + 13, &set->merge_factor) < 0 ||
+			    set->merge_factor == 1) {
+				i_error("fts_lucene: Invalid merge_factor: %s",
+					*tmp + 13);
+				return -1;
+			}
+		} else if (strcmp(*tmp, "keep_writer_open") == 0) {
+			set->keep_writer_open_secs =
+				FTS_LUCENE_DEFAULT_KEEP_WRITER_OPEN_SECS;
+		} else if (strncmp(*tmp, "keep_writer_open=", 17) == 0) {
+			if (str_to_uint(*tmp + 17,
+					&set->keep_writer_open_secs) < 0 ||
+			    set->keep_writer_open_secs >
+			    FTS_LUCENE_MAX_KEEP_WRITER_OPEN_SECS) {
+				i_error("fts_lucene: Invalid keep_writer_open: %s",
+					*tmp + 17);
+				return -1;
+			}
 		} else {
 			i_error("fts_lucene: Invalid setting: %s", *tmp);
 			return -1;
@@ -82,7 +107,8 @@ uint32_t fts_lucene_settings_checksum(const struct fts_lucene_settings *set)
 	if (set->no_snowball)
 		crc = crc32_str_more(crc, "s");
 	/* don't include mime_parts here, since changing it doesn't
-	   necessarily need the index to be rebuilt */
+	   necessarily need the index to be rebuilt. the writer tuning
+	   settings don't affect the index contents either. */
 	return crc;
 }
 
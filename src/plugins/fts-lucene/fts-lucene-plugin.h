@@ -8,13 +8,24 @@
 #define FTS_LUCENE_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_lucene_user_module)
 
+/* keep_writer_open without a value */
+#define FTS_LUCENE_DEFAULT_KEEP_WRITER_OPEN_SECS 5
+/* well below the 60 seconds after which other processes consider
+   the write.lock stale */
+#define FTS_LUCENE_MAX_KEEP_WRITER_OPEN_SECS 30
+
 struct fts_lucene_settings {
 	const char *default_language;
 	const char *textcat_conf, *textcat_dir;
 	const char *whitespace_chars;
+	unsigned int ram_buffer_mb, merge_factor;
 	bool normalize;
 	bool no_snowball;
 	bool mime_parts;
+	/* Seconds to keep the IndexWriter open after an update, so the next
+	   mailbox's update can reuse it. Other processes can't update the
+	   index while its write.lock is held. 0 = close after each update. */
+	unsigned int keep_writer_open_secs;
 };
 
 struct fts_lucene_user {
@@ -30,11 +30,16 @@ extern "C" {
 #include <CLucene.h>
 #include <CLucene/util/CLStreams.h>
 #include <CLucene/search/MultiPhraseQuery.h>
+#include <CLucene/search/QueryFilter.h>
+#include <CLucene/search/CachingWrapperFilter.h>
+#include <CLucene/util/BitSet.h>
 #include "SnowballAnalyzer.h"
 
 /* Lucene's default is 10000. Use it here also.. */
 #define MAX_TERMS_PER_DOCUMENT 10000
 #define FTS_LUCENE_MAX_SEARCH_TERMS 1000
+/* Number of mailboxes whose document bitsets are cached */
+#define LUCENE_MAX_MAILBOX_FILTERS 16
 
 #define LUCENE_LOCK_OVERRIDE_SECS 60
 #define LUCENE_INDEX_CLOSE_TIMEOUT_MSECS (120*1000)
@@ -58,6 +63,16 @@ struct lucene_analyzer {
 	Analyzer *analyzer;
 };
 
+struct lucene_mailbox_filter {
+	wchar_t guid[MAILBOX_GUID_HEX_LENGTH + 1];
+	/* box:guid query that the filter was created from. the filter
+	   refers to its term, so it must live as long as the filter. */
+	Query *query;
+	/* caches the mailbox's documents as a bitset for the current
+	   reader */
+	Filter *filter;
+};
+
 struct lucene_index {
 	char *path;
 	struct mailbox_list *list;
@@ -69,14 +84,17 @@ struct lucene_index {
 	IndexReader *reader;
 	IndexWriter *writer;
 	IndexSearcher *searcher;
-	struct timeout *to_close;
+	struct timeout *to_close, *to_close_writer;
 
 	buffer_t *normalizer_buf;
 	Analyzer *default_analyzer, *cur_analyzer;
 	ARRAY(struct lucene_analyzer) analyzers;
+	/* the most recently used one is last */
+	ARRAY(struct lucene_mailbox_filter) mailbox_filters;
 
 	Document *doc;
 	uint32_t prev_uid, prev_part_idx;
+	bool building;
 };
 
 struct rescan_context {
@@ -140,17 +158,17 @@ struct lucene_index *lucene_index_init(const char *path,
 	}
 
 	i_array_init(&index->analyzers, 32);
+	i_array_init(&index->mailbox_filters, LUCENE_MAX_MAILBOX_FILTERS);
 	textcat_refcount++;
 
 	return index;
 }
 
-void lucene_index_close(struct lucene_index *index)
+static void lucene_index_close_writer(struct lucene_index *index)
 {
-	if (index->to_close != NULL)
-		timeout_remove(&index->to_close);
+	if (index->to_close_writer != NULL)
+		timeout_remove(&index->to_close_writer);
 
-	_CLDELETE(index->searcher);
 	if (index->writer != NULL) {
 		try {
 			index->writer->close();
@@ -159,6 +177,37 @@ void lucene_index_close(struct lucene_index *index)
 		}
 		_CLDELETE(index->writer);
 	}
+}
+
+static void lucene_index_writer_timeout(struct lucene_index *index)
+{
+	if (index->building) {
+		/* still in use */
+		timeout_reset(index->to_close_writer);
+		return;
+	}
+	lucene_index_close_writer(index);
+}
+
+static void lucene_index_free_filters(struct lucene_index *index)
+{
+	struct lucene_mailbox_filter *f;
+
+	array_foreach_modifiable(&index->mailbox_filters, f) {
+		_CLDELETE(f->filter);
+		_CLDELETE(f->query);
+	}
+	array_clear(&index->mailbox_filters);
+}
+
+static void lucene_index_close_reader(struct lucene_index *index)
+{
+	if (index->to_close != NULL)
+		timeout_remove(&index->to_close);
+
+	/* the cached bitsets are valid only for this reader */
+	lucene_index_free_filters(index);
+	_CLDELETE(index->searcher);
 	if (index->reader != NULL) {
 		try {
 			index->reader->close();
@@ -169,6 +218,31 @@ void lucene_index_close(struct lucene_index *index)
 	}
 }
 
+void lucene_index_close(struct lucene_index *index)
+{
+	lucene_index_close_reader(index);
+	lucene_index_close_writer(index);
+}
+
+void lucene_index_refresh(struct lucene_index *index)
+{
+	bool current;
+
+	if (index->reader == NULL)
+		return;
+
+	/* keep the searcher as long as nothing has been committed to the
+	   index since it was opened. this only reads the segments file. */
+	try {
+		current = index->reader->isCurrent();
+	} catch (CLuceneError &err) {
+		lucene_handle_error(index, err, "IndexReader::isCurrent()");
+		current = false;
+	}
+	if (!current)
+		lucene_index_close_reader(index);
+}
+
 void lucene_index_deinit(struct lucene_index *index)
 {
 	struct lucene_analyzer *a;
@@ -179,6 +253,7 @@ void lucene_index_deinit(struct lucene_index *index)
 		_CLDELETE(a->analyzer);
 	}
 	array_free(&index->analyzers);
+	array_free(&index->mailbox_filters);
 	if (--textcat_refcount == 0 && textcat != NULL) {
 #ifdef HAVE_LUCENE_TEXTCAT
 		textcat_Done(textcat);
@@ -297,7 +372,7 @@ static int lucene_index_open(struct lucene_index *index)
 	}
 	i_assert(index->to_close == NULL);
 	index->to_close = timeout_add(LUCENE_INDEX_CLOSE_TIMEOUT_MSECS,
-				      lucene_index_close, index);
+				      lucene_index_close_reader, index);
 	return 1;
 }
 
@@ -351,6 +426,41 @@ lucene_doc_get_part(struct lucene_index *index, Document *doc)
 	return num;
 }
 
+static Filter *
+lucene_index_get_mailbox_filter(struct lucene_index *index,
+				const wchar_t *guid)
+{
+	struct lucene_mailbox_filter *filters, new_filter;
+	unsigned int i, count;
+
+	filters = array_get_modifiable(&index->mailbox_filters, &count);
+	for (i = 0; i < count; i++) {
+		if (wcscmp(filters[i].guid, guid) == 0) {
+			new_filter = filters[i];
+			array_delete(&index->mailbox_filters, i, 1);
+			array_append(&index->mailbox_filters, &new_filter, 1);
+			return new_filter.filter;
+		}
+	}
+	if (count >= LUCENE_MAX_MAILBOX_FILTERS) {
+		_CLDELETE(filters[0].filter);
+		_CLDELETE(filters[0].query);
+		array_delete(&index->mailbox_filters, 0, 1);
+	}
+
+	memset(&new_filter, 0, sizeof(new_filter));
+	memcpy(new_filter.guid, guid,
+	       MAILBOX_GUID_HEX_LENGTH * sizeof(wchar_t));
+	Term *term = _CLNEW Term(_T("box"), new_filter.guid);
+	new_filter.query = _CLNEW TermQuery(term);
+	_CLDECDELETE(term);
+	new_filter.filter =
+		_CLNEW CachingWrapperFilter(_CLNEW QueryFilter(new_filter.query),
+					    true);
+	array_append(&index->mailbox_filters, &new_filter, 1);
+	return new_filter.filter;
+}
+
 int lucene_index_get_last_uid(struct lucene_index *index, uint32_t *last_uid_r)
 {
 	int ret = 0;
@@ -393,7 +503,7 @@ int lucene_index_get_doc_count(struct lucene_index *index, uint32_t *count_r)
 	int ret;
 
 	if (index->reader == NULL) {
-		lucene_index_close(index);
+		lucene_index_close_reader(index);
 		if ((ret = lucene_index_open(index)) < 0)
 			return -1;
 		if (ret == 0) {
@@ -433,6 +543,13 @@ int lucene_index_build_init(struct lucene_index *index)
 	const char *lock_path;
 	struct stat st;
 
+	if (index->writer != NULL) {
+		/* kept open by keep_writer_open */
+		i_assert(index->set.keep_writer_open_secs != 0);
+		timeout_reset(index->to_close_writer);
+		index->building = TRUE;
+		return 0;
+	}
 	lucene_index_close(index);
 
 	lock_path = t_strdup_printf("%s/write.lock", index->path);
@@ -455,6 +572,16 @@ int lucene_index_build_init(struct lucene_index *index)
 		return -1;
 	}
 	index->writer->setMaxFieldLength(MAX_TERMS_PER_DOCUMENT);
+	if (index->set.ram_buffer_mb != 0)
+		index->writer->setRAMBufferSizeMB(index->set.ram_buffer_mb);
+	if (index->set.merge_factor != 0)
+		index->writer->setMergeFactor(index->set.merge_factor);
+	if (index->set.keep_writer_open_secs != 0) {
+		index->to_close_writer =
+			timeout_add(index->set.keep_writer_open_secs * 1000,
+				    lucene_index_writer_timeout, index);
+	}
+	index->building = TRUE;
 	return 0;
 }
 
@@ -619,8 +746,11 @@ int lucene_index_build_deinit(struct lucene_index *index)
 {
 	int ret = 0;
 
+	index->building = FALSE;
 	if (index->prev_uid == 0) {
 		/* no changes. */
+		if (index->set.keep_writer_open_secs == 0)
+			lucene_index_close_writer(index);
 		return 0;
 	}
 	index->prev_uid = 0;
@@ -634,6 +764,21 @@ int lucene_index_build_deinit(struct lucene_index *index)
 	if (lucene_index_build_flush(index) < 0)
 		ret = -1;
 
+	if (index->set.keep_writer_open_secs != 0) {
+		/* commit the documents so they're visible to searches, but
+		   keep the writer for the next mailbox */
+		try {
+			index->writer->flush();
+		} catch (CLuceneError &err) {
+			lucene_handle_error(index, err, "IndexWriter::flush()");
+			ret = -1;
+		}
+		lucene_index_close_reader(index);
+		if (ret < 0)
+			lucene_index_close_writer(index);
+		return ret;
+	}
+
 	try {
 		index->writer->close();
 	} catch (CLuceneError &err) {
@@ -855,6 +1000,8 @@ int lucene_index_rescan(struct lucene_index *index)
 
 	i_assert(index->list != NULL);
 
+	/* deleting documents needs the write lock */
+	lucene_index_close_writer(index);
 	if ((ret = lucene_index_open_search(index)) < 0)
 		return ret;
 
@@ -911,71 +1058,95 @@ static void guid128_to_wguid(const guid_128_t guid,
 	wguid_hex[i] = '\0';
 }
 
-static bool
-lucene_index_add_uid_filter(BooleanQuery *query,
-			    const struct fts_expunge_log_read_record *rec)
+static void
+lucene_index_add_uid_bits(TermDocs *docs, Term *term, BitSet *bits)
 {
+	docs->seek(term);
+	while (docs->next())
+		bits->set(docs->doc());
+}
+
+static BitSet *
+lucene_index_get_uid_bits(struct lucene_index *index,
+			  const ARRAY_TYPE(seq_range) *uids)
+{
+	BitSet *bits = _CLNEW BitSet(index->reader->maxDoc());
+	TermDocs *docs = index->reader->termDocs();
 	struct seq_range_iter iter;
 	wchar_t wuid[MAX_INT_STRLEN];
 	unsigned int n;
 	uint32_t uid;
 
-	/* RangeQuery and WildcardQuery work by enumerating through all terms
-	   that match them, and then adding TermQueries for them. So we can
-	   simply do the same directly, and if it looks like there are too
-	   many terms just go through everything. */
-
-	if (seq_range_count(&rec->uids) > FTS_LUCENE_MAX_SEARCH_TERMS)
-		return false;
+	if (seq_range_count(uids) <= FTS_LUCENE_MAX_SEARCH_TERMS) {
+		/* look up the postings of each UID directly */
+		seq_range_array_iter_init(&iter, uids); n = 0;
+		while (seq_range_array_iter_nth(&iter, n++, &uid)) {
+			swprintf(wuid, N_ELEMENTS(wuid), L"%u", uid);
 
-	seq_range_array_iter_init(&iter, &rec->uids); n = 0;
-	while (seq_range_array_iter_nth(&iter, n++, &uid)) {
-		swprintf(wuid, N_ELEMENTS(wuid), L"%u", uid);
-
-		Term *term = _CLNEW Term(_T("uid"), wuid);
-		query->add(_CLNEW TermQuery(term), true, BooleanClause::SHOULD);
-		_CLDECDELETE(term);
-	}
-	return true;
+			Term *term = _CLNEW Term(_T("uid"), wuid);
+			lucene_index_add_uid_bits(docs, term, bits);
+			_CLDECDELETE(term);
+		}
+	} else {
+		/* too many UIDs to look up one by one. go through all the
+		   uid terms instead, there's only one per distinct UID. */
+		Term *first = _CLNEW Term(_T("uid"), _T(""));
+		TermEnum *terms = index->reader->terms(first);
+		_CLDECDELETE(first);
+		do {
+			Term *term = terms->term();
+			if (term == NULL)
+				break;
+			if (wcscmp(term->field(), _T("uid")) != 0) {
+				_CLDECDELETE(term);
+				break;
+			}
+			uid = wcstoul(term->text(), NULL, 10);
+			if (seq_range_exists(uids, uid))
+				lucene_index_add_uid_bits(docs, term, bits);
+			_CLDECDELETE(term);
+		} while (terms->next());
+		terms->close();
+		_CLDELETE(terms);
+	}
+	docs->close();
+	_CLDELETE(docs);
+	return bits;
 }
 
 static int
 lucene_index_expunge_record(struct lucene_index *index,
 			    const struct fts_expunge_log_read_record *rec)
 {
+	BitSet *uid_bits = NULL, *box_bits = NULL;
+	Filter *filter;
 	int ret;
 
 	if ((ret = lucene_index_open_search(index)) <= 0)
 		return ret;
 
-	BooleanQuery query;
-	BooleanQuery uids_query;
-
-	if (lucene_index_add_uid_filter(&uids_query, rec))
-		query.add(&uids_query, BooleanClause::MUST);
-
 	wchar_t wguid[MAILBOX_GUID_HEX_LENGTH + 1];
 	guid128_to_wguid(rec->mailbox_guid, wguid);
-	Term term(_T("box"), wguid);
-	TermQuery mailbox_query(&term);
-	query.add(&mailbox_query, BooleanClause::MUST);
+	filter = lucene_index_get_mailbox_filter(index, wguid);
 
+	/* the expunged documents are the AND of the mailbox's cached bitset
+	   and the bitset of the expunged UIDs' documents */
 	try {
-		Hits *hits = index->searcher->search(&query);
+		uid_bits = lucene_index_get_uid_bits(index, &rec->uids);
+		box_bits = filter->bits(index->reader);
 
-		for (size_t i = 0; i < hits->length(); i++) {
-			uint32_t uid;
-
-			if (lucene_doc_get_uid(index, &hits->doc(i),
-					       &uid) < 0 ||
-			    seq_range_exists(&rec->uids, uid))
-				index->reader->deleteDocument(hits->id(i));
+		int32_t i, count = index->reader->maxDoc();
+		for (i = 0; i < count; i++) {
+			if (uid_bits->get(i) && box_bits->get(i))
+				index->reader->deleteDocument(i);
 		}
-		_CLDELETE(hits);
 	} catch (CLuceneError &err) {
-		lucene_handle_error(index, err, "expunge search");
+		lucene_handle_error(index, err, "expunge");
 		ret = -1;
 	}
+	if (box_bits != NULL && filter->shouldDeleteBitSet(box_bits))
+		_CLDELETE(box_bits);
+	_CLDELETE(uid_bits);
 	return ret < 0 ? -1 : 0;
 }
 
@@ -986,6 +1157,8 @@ int lucene_index_expunge_from_log(struct lucene_index *index,
 	const struct fts_expunge_log_read_record *rec;
 	int ret = 0, ret2;
 
+	/* deleting documents needs the write lock */
+	lucene_index_close_writer(index);
 	ctx = fts_expunge_log_read_begin(log);
 	while ((rec = fts_expunge_log_read_next(ctx)) != NULL) {
 		if (lucene_index_expunge_record(index, rec) < 0) {
@@ -1008,6 +1181,8 @@ int lucene_index_optimize(struct lucene_index *index)
 
 	if (!IndexReader::indexExists(index->path))
 		return 0;
+	/* don't let the forced unlock below break our own writer */
+	lucene_index_close_writer(index);
 	if (IndexReader::isLocked(index->path))
 		IndexReader::unlock(index->path);
 
@@ -1281,7 +1456,9 @@ static bool queries_have_non_must_nots(ARRAY_TYPE(lucene_query) &queries)
 	return FALSE;
 }
 
-static void search_query_add(BooleanQuery &query,
+/* Returns true if the query can match documents by itself, false if it has
+   only MUST_NOT clauses. */
+static bool search_query_add(BooleanQuery &query,
 			     ARRAY_TYPE(lucene_query) &queries)
 {
 	BooleanQuery *search_query = _CLNEW BooleanQuery();
@@ -1291,10 +1468,12 @@ static void search_query_add(BooleanQuery &query,
 		array_foreach(&queries, lq)
 			search_query->add(lq->query, true, lq->occur);
 		query.add(search_query, true, BooleanClause::MUST);
+		return true;
 	} else {
 		array_foreach(&queries, lq)
 			search_query->add(lq->query, true, BooleanClause::SHOULD);
 		query.add(search_query, true, BooleanClause::MUST_NOT);
+		return false;
 	}
 }
 
@@ -1307,14 +1486,24 @@ lucene_index_search(struct lucene_index *index,
 	int ret = 0;
 
 	BooleanQuery query;
-	search_query_add(query, queries);
+	Filter *filter = NULL;
 
 	Term mailbox_term(_T("box"), index->mailbox_guid);
 	TermQuery mailbox_query(&mailbox_term);
-	query.add(&mailbox_query, BooleanClause::MUST);
+	if (search_query_add(query, queries)) {
+		/* restrict to the mailbox with its cached bitset instead of
+		   intersecting with the mailbox's term postings */
+		filter = lucene_index_get_mailbox_filter(index,
+							 index->mailbox_guid);
+	} else {
+		/* a query with only MUST_NOT clauses doesn't match anything
+		   without a positive clause */
+		query.add(&mailbox_query, BooleanClause::MUST);
+	}
 
 	try {
-		Hits *hits = index->searcher->search(&query);
+		Hits *hits = filter == NULL ? index->searcher->search(&query) :
+			index->searcher->search(&query, filter);
 
 		uint32_t last_uid = 0;
 		if (result != NULL)
@@ -1416,7 +1605,7 @@ lucene_index_search_multi(struct lucene_index *index,
 	int ret = 0;
 
 	BooleanQuery query;
-	search_query_add(query, queries);
+	(void)search_query_add(query, queries);
 
 	BooleanQuery mailbox_query;
 	struct hash_iterate_context *iter;
@@ -36,6 +36,8 @@ int lucene_index_build_more(struct lucene_index *index, uint32_t uid,
 int lucene_index_build_deinit(struct lucene_index *index);
 
 void lucene_index_close(struct lucene_index *index);
+/* Close the searcher if the index has changed since it was opened. */
+void lucene_index_refresh(struct lucene_index *index);
 int lucene_index_rescan(struct lucene_index *index);
 int lucene_index_expunge_from_log(struct lucene_index *index,
 				  struct fts_expunge_log *log);
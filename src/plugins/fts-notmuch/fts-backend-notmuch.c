@@ -4,22 +4,135 @@
 #include "hash.h"
 #include "strescape.h"
 #include "unichar.h"
+#include "time-util.h"
 #include "mail-storage-private.h"
 #include "mailbox-list-private.h"
 #include "mail-search.h"
+#include "maildir-storage.h"
+#include "maildir-filename.h"
 #include "fts-api.h"
+#include "fts-expunge-log.h"
+#include "notmuch-uidmap.h"
 #include "fts-notmuch-plugin.h"
 
 #include <ctype.h>
-#include <syslog.h>
+#include <sys/time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <notmuch.h>
 
+#define NOTMUCH_EXPUNGE_LOG_NAME "dovecot-notmuch-expunges.log"
+
+struct notmuch_fts_database {
+	int refcount;
+	char *path;
+
+	/* read-only database handle kept open across lookups */
+	notmuch_database_t *db;
+};
+
+struct notmuch_fts_lookup_stats {
+	unsigned int queries;
+	unsigned int messages;
+	long long query_usecs;
+	/* time spent resolving the filenames to UIDs */
+	long long resolve_usecs;
+};
+
 struct notmuch_fts_backend {
 	struct fts_backend backend;
+	bool debug;
+	/* collected only with debugging, logged once per search */
+	struct notmuch_fts_lookup_stats stats;
+
+	/* shared by all the user's namespaces with the same database path */
+	struct notmuch_fts_database *database;
+
+	struct notmuch_uidmaps *uidmaps;
+	/* with lazy_expunge the expunges are removed only in optimize() */
+	struct fts_expunge_log *expunge_log;
 };
 
+struct notmuch_fts_backend_update_context {
+	struct fts_backend_update_context ctx;
+
+	struct mailbox *box;
+	uint32_t last_uid;
+
+	/* read-write database handle, opened on the first change and
+	   committed as a single atomic transaction in update_deinit() */
+	notmuch_database_t *db;
+
+	/* expunged UIDs of box, resolved to filenames when the mailbox
+	   is changed */
+	ARRAY_TYPE(seq_range) expunged_uids;
+	/* files to remove from the database in update_deinit() */
+	pool_t expunge_pool;
+	ARRAY_TYPE(const_string) expunged_paths;
+
+	struct fts_expunge_log_append_ctx *expunge_ctx;
+	uint32_t last_indexed_uid;
+	bool last_indexed_uid_set;
+};
+
+typedef void notmuch_filename_callback_t(const char *path, void *context);
+
+static int
+notmuch_query_filenames(notmuch_database_t *db, const char *terms,
+			notmuch_filename_callback_t *callback, void *context,
+			struct notmuch_fts_lookup_stats *stats);
+
+static struct notmuch_fts_database *
+notmuch_fts_database_get(struct fts_notmuch_user *fuser, const char *path)
+{
+	struct notmuch_fts_database *const *databasep, *database;
+
+	if (!array_is_created(&fuser->databases))
+		i_array_init(&fuser->databases, 2);
+	array_foreach(&fuser->databases, databasep) {
+		if (strcmp((*databasep)->path, path) == 0) {
+			(*databasep)->refcount++;
+			return *databasep;
+		}
+	}
+
+	database = i_new(struct notmuch_fts_database, 1);
+	database->refcount = 1;
+	database->path = i_strdup(path);
+	array_append(&fuser->databases, &database, 1);
+	return database;
+}
+
+static void
+notmuch_fts_database_unref(struct fts_notmuch_user *fuser,
+			   struct notmuch_fts_database **_database)
+{
+	struct notmuch_fts_database *database = *_database;
+	struct notmuch_fts_database *const *databases;
+	unsigned int i, count;
+
+	*_database = NULL;
+	i_assert(database->refcount > 0);
+	if (--database->refcount > 0)
+		return;
+
+	databases = array_get(&fuser->databases, &count);
+	for (i = 0; i < count; i++) {
+		if (databases[i] == database) {
+			array_delete(&fuser->databases, i, 1);
+			break;
+		}
+	}
+	if (array_count(&fuser->databases) == 0)
+		array_free(&fuser->databases);
+
+	if (database->db != NULL)
+		(void)notmuch_database_destroy(database->db);
+	i_free(database->path);
+	i_free(database);
+}
+
 static struct fts_backend *fts_backend_notmuch_alloc(void)
 {
 	struct notmuch_fts_backend *backend;
@@ -30,17 +143,82 @@ static struct fts_backend *fts_backend_notmuch_alloc(void)
 }
 
 static int
-fts_backend_notmuch_init(struct fts_backend *_backend,
-                         const char **error_r ATTR_UNUSED)
+fts_backend_notmuch_init(struct fts_backend *_backend, const char **error_r)
 {
+	struct notmuch_fts_backend *backend = (struct notmuch_fts_backend *)_backend;
+	struct fts_notmuch_user *fuser =
+		FTS_NOTMUCH_USER_CONTEXT(_backend->ns->user);
+	const char *path;
+
+	if (fuser == NULL) {
+		/* invalid settings */
+		*error_r = "Invalid fts_notmuch settings";
+		return -1;
+	}
+
+	if (fuser->set.path != NULL)
+		path = fuser->set.path;
+	else {
+		/* notmuch is normally run on the maildir root */
+		path = mailbox_list_get_root_forced(_backend->ns->list,
+						    MAILBOX_LIST_PATH_TYPE_MAILBOX);
+	}
+	backend->database = notmuch_fts_database_get(fuser, path);
+	backend->debug = fuser->set.debug;
+	backend->uidmaps = notmuch_uidmaps_init();
+	if (fuser->set.lazy_expunge) {
+		path = mailbox_list_get_root_forced(_backend->ns->list,
+						    MAILBOX_LIST_PATH_TYPE_INDEX);
+		path = t_strconcat(path, "/"NOTMUCH_EXPUNGE_LOG_NAME, NULL);
+		backend->expunge_log = fts_expunge_log_init(path);
+	}
+	return 0;
+}
+
+static int fts_backend_notmuch_open(struct notmuch_fts_backend *backend)
+{
+	struct notmuch_fts_database *database = backend->database;
+	notmuch_status_t status;
+
+	if (database->db != NULL)
+		return 0;
+
+	status = notmuch_database_open(database->path,
+				       NOTMUCH_DATABASE_MODE_READ_ONLY,
+				       &database->db);
+	if (status != NOTMUCH_STATUS_SUCCESS) {
+		i_error("fts_notmuch: notmuch_database_open(%s) failed: %s",
+			database->path, notmuch_status_to_string(status));
+		database->db = NULL;
+		return -1;
+	}
 	return 0;
 }
 
+static void fts_backend_notmuch_close(struct notmuch_fts_backend *backend)
+{
+	struct notmuch_fts_database *database = backend->database;
+
+	if (database->db == NULL)
+		return;
+
+	(void)notmuch_database_destroy(database->db);
+	database->db = NULL;
+}
+
 static void
 fts_backend_notmuch_deinit(struct fts_backend *_backend)
 {
 	struct notmuch_fts_backend *backend = (struct notmuch_fts_backend *)_backend;
+	struct fts_notmuch_user *fuser =
+		FTS_NOTMUCH_USER_CONTEXT(_backend->ns->user);
 
+	if (backend->database != NULL)
+		notmuch_fts_database_unref(fuser, &backend->database);
+	if (backend->uidmaps != NULL)
+		notmuch_uidmaps_deinit(&backend->uidmaps);
+	if (backend->expunge_log != NULL)
+		fts_expunge_log_deinit(&backend->expunge_log);
 	i_free(backend);
 }
 
@@ -61,97 +239,734 @@ fts_backend_notmuch_get_last_uid(struct fts_backend *_backend,
 }
 
 static struct fts_backend_update_context *
-fts_backend_notmuch_update_init(struct fts_backend *backend)
+fts_backend_notmuch_update_init(struct fts_backend *_backend)
 {
-	struct fts_backend_update_context *ctx;
+	struct notmuch_fts_backend_update_context *ctx;
 
-	ctx = i_new(struct fts_backend_update_context, 1);
-	ctx->backend = backend;
-	return ctx;
+	ctx = i_new(struct notmuch_fts_backend_update_context, 1);
+	ctx->ctx.backend = _backend;
+	i_array_init(&ctx->expunged_uids, 32);
+	return &ctx->ctx;
 }
 
 static int
-fts_backend_notmuch_update_deinit(struct fts_backend_update_context *ctx)
+notmuch_update_begin(struct notmuch_fts_backend_update_context *ctx)
 {
-	i_free(ctx);
+	struct notmuch_fts_backend *backend =
+		(struct notmuch_fts_backend *)ctx->ctx.backend;
+	const char *db_path = backend->database->path;
+	notmuch_status_t status;
+
+	if (ctx->db != NULL)
+		return 0;
+
+	/* the read-write handle holds the database's write lock, so it's
+	   opened only for the duration of the update */
+	status = notmuch_database_open(db_path,
+				       NOTMUCH_DATABASE_MODE_READ_WRITE,
+				       &ctx->db);
+	if (status != NOTMUCH_STATUS_SUCCESS) {
+		i_error("fts_notmuch: notmuch_database_open(%s) failed: %s",
+			db_path, notmuch_status_to_string(status));
+		ctx->db = NULL;
+		return -1;
+	}
+	status = notmuch_database_begin_atomic(ctx->db);
+	if (status != NOTMUCH_STATUS_SUCCESS) {
+		i_error("fts_notmuch: notmuch_database_begin_atomic(%s) failed: %s",
+			db_path, notmuch_status_to_string(status));
+		(void)notmuch_database_destroy(ctx->db);
+		ctx->db = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+notmuch_update_commit(struct notmuch_fts_backend_update_context *ctx)
+{
+	struct notmuch_fts_backend *backend =
+		(struct notmuch_fts_backend *)ctx->ctx.backend;
+	const char *db_path = backend->database->path;
+	notmuch_status_t status;
+	int ret = 0;
+
+	if (ctx->db == NULL)
+		return 0;
+
+	status = notmuch_database_end_atomic(ctx->db);
+	if (status != NOTMUCH_STATUS_SUCCESS) {
+		i_error("fts_notmuch: notmuch_database_end_atomic(%s) failed: %s",
+			db_path, notmuch_status_to_string(status));
+		ret = -1;
+	}
+	status = notmuch_database_destroy(ctx->db);
+	if (status != NOTMUCH_STATUS_SUCCESS) {
+		i_error("fts_notmuch: notmuch_database_close(%s) failed: %s",
+			db_path, notmuch_status_to_string(status));
+		ret = -1;
+	}
+	ctx->db = NULL;
+	return ret;
+}
+
+static int
+notmuch_remove_files(notmuch_database_t *db,
+		     const ARRAY_TYPE(const_string) *paths)
+{
+	const char *const *pathp;
+	notmuch_status_t status;
+	int ret = 0;
+
+	array_foreach(paths, pathp) {
+		status = notmuch_database_remove_message(db, *pathp);
+		switch (status) {
+		case NOTMUCH_STATUS_SUCCESS:
+		case NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID:
+			/* duplicate means that the message still has
+			   other filenames */
+			break;
+		default:
+			i_error("fts_notmuch: "
+				"notmuch_database_remove_message(%s) failed: %s",
+				*pathp, notmuch_status_to_string(status));
+			ret = -1;
+			break;
+		}
+	}
+	return ret;
+}
+
+static void notmuch_quote_term(string_t *dest, const char *str)
+{
+	str_append_c(dest, '"');
+	for (; *str != '\0'; str++) {
+		if (*str == '"')
+			str_append_c(dest, '"');
+		str_append_c(dest, *str);
+	}
+	str_append_c(dest, '"');
+}
+
+struct notmuch_reconcile_context {
+	struct notmuch_uidmap *uidmap;
+	pool_t pool;
+	ARRAY_TYPE(const_string) *paths;
+};
+
+static void notmuch_reconcile_add_filename(const char *path, void *context)
+{
+	struct notmuch_reconcile_context *ctx = context;
+	struct stat st;
+	uint32_t uid;
+
+	if (!notmuch_uidmap_path_in_mailbox(ctx->uidmap, path) ||
+	    notmuch_uidmap_lookup(ctx->uidmap, path, &uid))
+		return;
+	/* the file may have been delivered after the uidlist was read */
+	if (stat(path, &st) == 0 || errno != ENOENT)
+		return;
+	path = p_strdup(ctx->pool, path);
+	array_append(ctx->paths, &path, 1);
+}
+
+static int
+notmuch_get_folder_query(struct notmuch_fts_backend *backend,
+			 struct mailbox *box, struct notmuch_uidmap *uidmap,
+			 const char **query_r)
+{
+	const char *box_path;
+	size_t db_path_len = strlen(backend->database->path);
+	string_t *terms;
+
+	box_path = notmuch_uidmap_get_path(uidmap);
+	if (strncmp(box_path, backend->database->path, db_path_len) != 0 ||
+	    (box_path[db_path_len] != '/' && box_path[db_path_len] != '\0')) {
+		i_error("fts_notmuch: Mailbox %s path %s isn't under "
+			"the notmuch database %s", box->vname, box_path,
+			backend->database->path);
+		return -1;
+	}
+	box_path += db_path_len;
+	if (*box_path == '/')
+		box_path++;
+
+	terms = t_str_new(128);
+	str_append(terms, "folder:");
+	notmuch_quote_term(terms, box_path);
+	*query_r = str_c(terms);
 	return 0;
 }
 
+static int
+notmuch_expunge_reconcile(struct notmuch_fts_backend *backend,
+			  notmuch_database_t *db, struct mailbox *box,
+			  pool_t pool, ARRAY_TYPE(const_string) *paths)
+{
+	struct notmuch_reconcile_context ctx;
+	const char *terms;
+
+	memset(&ctx, 0, sizeof(ctx));
+	if (notmuch_uidmap_get(backend->uidmaps, box, &ctx.uidmap) < 0)
+		return -1;
+	ctx.pool = pool;
+	ctx.paths = paths;
+
+	/* find the folder's files that no longer exist in the mailbox */
+	if (notmuch_get_folder_query(backend, box, ctx.uidmap, &terms) < 0)
+		return -1;
+	return notmuch_query_filenames(db, terms,
+				       notmuch_reconcile_add_filename, &ctx, NULL);
+}
+
+static void
+notmuch_update_init_expunged_paths(struct notmuch_fts_backend_update_context *ctx)
+{
+	if (ctx->expunge_pool != NULL)
+		return;
+	ctx->expunge_pool = pool_alloconly_create("notmuch expunges", 1024);
+	p_array_init(&ctx->expunged_paths, ctx->expunge_pool, 32);
+}
+
+struct notmuch_expunge_context {
+	struct notmuch_uidmap *uidmap;
+	/* expunged messages' filenames sorted by their base name */
+	ARRAY_TYPE(const_string) fnames;
+	pool_t pool;
+	ARRAY_TYPE(const_string) *paths;
+};
+
+static int notmuch_expunge_fname_cmp(const char *const *fname1,
+				     const char *const *fname2)
+{
+	return maildir_filename_base_cmp(*fname1, *fname2);
+}
+
+static void notmuch_expunge_add_filename(const char *path, void *context)
+{
+	struct notmuch_expunge_context *ctx = context;
+	const char *fname;
+
+	/* the flags may have changed after the uidlist was read, so
+	   match the files by their base name */
+	fname = notmuch_uidmap_path_get_fname(ctx->uidmap, path);
+	if (fname == NULL ||
+	    array_bsearch(&ctx->fnames, &fname,
+			  notmuch_expunge_fname_cmp) == NULL)
+		return;
+	path = p_strdup(ctx->pool, path);
+	array_append(ctx->paths, &path, 1);
+}
+
+static int
+notmuch_update_resolve_expunges(struct notmuch_fts_backend_update_context *ctx)
+{
+	struct notmuch_fts_backend *backend =
+		(struct notmuch_fts_backend *)ctx->ctx.backend;
+	struct notmuch_expunge_context ectx;
+	struct seq_range_iter iter;
+	const char *guid, *fname, *terms;
+	unsigned int n = 0;
+	uint32_t uid;
+	bool reconcile = FALSE;
+
+	if (fts_mailbox_get_guid(ctx->box, &guid) < 0)
+		return -1;
+
+	notmuch_update_init_expunged_paths(ctx);
+
+	/* the expunged messages are already gone from the uidlist, but the
+	   map built by the previous lookup or update still has them. */
+	memset(&ectx, 0, sizeof(ectx));
+	ectx.uidmap = notmuch_uidmap_get_cached(backend->uidmaps, guid);
+	ectx.pool = ctx->expunge_pool;
+	ectx.paths = &ctx->expunged_paths;
+	t_array_init(&ectx.fnames, seq_range_count(&ctx->expunged_uids) + 1);
+	seq_range_array_iter_init(&iter, &ctx->expunged_uids);
+	while (seq_range_array_iter_nth(&iter, n++, &uid)) {
+		fname = ectx.uidmap == NULL ? NULL :
+			notmuch_uidmap_get_uid_fname(ectx.uidmap, uid);
+		if (fname == NULL) {
+			reconcile = TRUE;
+			break;
+		}
+		array_append(&ectx.fnames, &fname, 1);
+	}
+	array_clear(&ctx->expunged_uids);
+
+	if (notmuch_update_begin(ctx) < 0)
+		return -1;
+	if (reconcile) {
+		return notmuch_expunge_reconcile(backend, ctx->db, ctx->box,
+						 ctx->expunge_pool,
+						 &ctx->expunged_paths);
+	}
+	if (array_count(&ectx.fnames) == 0)
+		return 0;
+
+	/* find the files notmuch has for the expunged messages */
+	array_sort(&ectx.fnames, notmuch_expunge_fname_cmp);
+	if (notmuch_get_folder_query(backend, ctx->box, ectx.uidmap,
+				     &terms) < 0)
+		return -1;
+	return notmuch_query_filenames(ctx->db, terms,
+				       notmuch_expunge_add_filename, &ectx,
+				       NULL);
+}
+
+static int
+fts_backend_notmuch_update_deinit(struct fts_backend_update_context *_ctx)
+{
+	struct notmuch_fts_backend_update_context *ctx =
+		(struct notmuch_fts_backend_update_context *)_ctx;
+	int ret = _ctx->failed ? -1 : 0;
+
+	i_assert(array_count(&ctx->expunged_uids) == 0);
+
+	if (ctx->expunge_pool != NULL &&
+	    array_count(&ctx->expunged_paths) > 0) {
+		/* removed within the same transaction as the additions */
+		if (notmuch_update_begin(ctx) < 0 ||
+		    notmuch_remove_files(ctx->db, &ctx->expunged_paths) < 0)
+			ret = -1;
+	}
+	if (notmuch_update_commit(ctx) < 0)
+		ret = -1;
+	if (ctx->expunge_ctx != NULL) {
+		if (fts_expunge_log_append_commit(&ctx->expunge_ctx) < 0)
+			ret = -1;
+	}
+	array_free(&ctx->expunged_uids);
+	if (ctx->expunge_pool != NULL)
+		pool_unref(&ctx->expunge_pool);
+	i_free(ctx);
+	return ret;
+}
+
 static void
-fts_backend_notmuch_update_set_mailbox(struct fts_backend_update_context *ctx,
-                                       struct mailbox *box)
+fts_backend_notmuch_update_set_mailbox(struct fts_backend_update_context *_ctx,
+				       struct mailbox *box)
+{
+	struct notmuch_fts_backend_update_context *ctx =
+		(struct notmuch_fts_backend_update_context *)_ctx;
+	int ret;
+
+	if (ctx->last_uid != 0) {
+		fts_index_set_last_uid(ctx->box, ctx->last_uid);
+		ctx->last_uid = 0;
+	}
+	if (array_count(&ctx->expunged_uids) > 0) {
+		T_BEGIN {
+			ret = notmuch_update_resolve_expunges(ctx);
+		} T_END;
+		if (ret < 0)
+			_ctx->failed = TRUE;
+		array_clear(&ctx->expunged_uids);
+	}
+	ctx->box = box;
+	ctx->last_indexed_uid_set = FALSE;
+}
+
+static void
+notmuch_update_log_expunge(struct notmuch_fts_backend_update_context *ctx,
+			   uint32_t uid)
+{
+	struct notmuch_fts_backend *backend =
+		(struct notmuch_fts_backend *)ctx->ctx.backend;
+	struct mailbox_metadata metadata;
+
+	if (mailbox_get_metadata(ctx->box, MAILBOX_METADATA_GUID,
+				 &metadata) < 0) {
+		ctx->ctx.failed = TRUE;
+		return;
+	}
+	if (ctx->expunge_ctx == NULL) {
+		ctx->expunge_ctx =
+			fts_expunge_log_append_begin(backend->expunge_log);
+	}
+	fts_expunge_log_append_next(ctx->expunge_ctx, metadata.guid, uid);
+}
+
+static void
+fts_backend_notmuch_update_expunge(struct fts_backend_update_context *_ctx,
+				   uint32_t uid)
+{
+	struct notmuch_fts_backend_update_context *ctx =
+		(struct notmuch_fts_backend_update_context *)_ctx;
+	struct notmuch_fts_backend *backend =
+		(struct notmuch_fts_backend *)_ctx->backend;
+	struct fts_index_header hdr;
+
+	if (!ctx->last_indexed_uid_set) {
+		if (!fts_index_get_header(ctx->box, &hdr))
+			ctx->last_indexed_uid = 0;
+		else
+			ctx->last_indexed_uid = hdr.last_indexed_uid;
+		ctx->last_indexed_uid_set = TRUE;
+	}
+	if (ctx->last_indexed_uid == 0 ||
+	    uid > ctx->last_indexed_uid + 100) {
+		/* don't waste time on a message that isn't even indexed.
+		   the indexer may be in the middle of indexing this message,
+		   so skip it only if indexing hasn't been done for a while
+		   (100 msgs). */
+		return;
+	}
+
+	if (backend->expunge_log != NULL)
+		notmuch_update_log_expunge(ctx, uid);
+	else
+		seq_range_array_add(&ctx->expunged_uids, uid);
+}
+
+static int
+notmuch_index_file(struct maildir_mailbox *mbox, const char *path,
+		   struct notmuch_fts_backend_update_context *ctx)
 {
-	return;
+	notmuch_message_t *message;
+	notmuch_status_t status;
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		i_error("fts_notmuch: stat(%s) failed: %m", path);
+		return -1;
+	}
+
+	status = notmuch_database_index_file(ctx->db, path, NULL, &message);
+	switch (status) {
+	case NOTMUCH_STATUS_SUCCESS:
+	case NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID:
+		/* duplicate means that the filename was added to an
+		   already existing message */
+		notmuch_message_destroy(message);
+		return 1;
+	case NOTMUCH_STATUS_FILE_NOT_EMAIL:
+		i_warning("fts_notmuch: Mailbox %s UID=%u: "
+			  "%s isn't recognized as an email, skipping",
+			  mbox->box.vname, ctx->last_uid, path);
+		return 1;
+	default:
+		i_error("fts_notmuch: notmuch_database_index_file(%s) failed: %s",
+			path, notmuch_status_to_string(status));
+		return -1;
+	}
 }
 
 static void
-fts_backend_notmuch_update_expunge(struct fts_backend_update_context *ctx, uint32_t uid)
+notmuch_update_index_uid(struct notmuch_fts_backend_update_context *ctx,
+			 uint32_t uid)
 {
-	return;
+	struct maildir_mailbox *mbox = (struct maildir_mailbox *)ctx->box;
+
+	if (strcmp(ctx->box->storage->name, MAILDIR_STORAGE_NAME) != 0) {
+		i_error("fts_notmuch: Mailbox %s isn't in maildir format",
+			ctx->box->vname);
+		ctx->ctx.failed = TRUE;
+		return;
+	}
+	if (notmuch_update_begin(ctx) < 0) {
+		ctx->ctx.failed = TRUE;
+		return;
+	}
+
+	/* notmuch parses and indexes the whole file by itself */
+	ctx->last_uid = uid;
+	if (maildir_file_do(mbox, uid, notmuch_index_file, ctx) < 0)
+		ctx->ctx.failed = TRUE;
 }
 
 static bool
-fts_backend_notmuch_update_set_build_key(struct fts_backend_update_context *ctx,
-                                         const struct fts_backend_build_key *key)
+fts_backend_notmuch_update_set_build_key(struct fts_backend_update_context *_ctx,
+					 const struct fts_backend_build_key *key)
 {
-	return TRUE;
+	struct notmuch_fts_backend_update_context *ctx =
+		(struct notmuch_fts_backend_update_context *)_ctx;
+
+	if (key->uid != ctx->last_uid && !_ctx->failed) {
+		i_assert(key->uid > ctx->last_uid);
+		notmuch_update_index_uid(ctx, key->uid);
+	}
+	/* the message was already indexed from its file, so there's no
+	   need to send us its contents */
+	return FALSE;
 }
 
 static void
-fts_backend_notmuch_update_unset_build_key(struct fts_backend_update_context *ctx)
+fts_backend_notmuch_update_unset_build_key(struct fts_backend_update_context *ctx ATTR_UNUSED)
 {
-	return;
 }
 
 static int
-fts_backend_notmuch_update_build_more(struct fts_backend_update_context *ctx,
-                                      const unsigned char *data, size_t size)
+fts_backend_notmuch_update_build_more(struct fts_backend_update_context *ctx ATTR_UNUSED,
+				      const unsigned char *data ATTR_UNUSED,
+				      size_t size ATTR_UNUSED)
 {
-	return 0;
+	i_unreached();
 }
 
-static int fts_backend_notmuch_refresh(struct fts_backend *backend ATTR_UNUSED)
+static int fts_backend_notmuch_refresh(struct fts_backend *_backend)
 {
+	struct notmuch_fts_backend *backend = (struct notmuch_fts_backend *)_backend;
+	struct notmuch_fts_database *database = backend->database;
+	notmuch_status_t status;
+
+	if (database->db == NULL)
+		return 0;
+
+	/* the handle's revision is the one it was opened at, so it can't
+	   tell whether anything newer was committed. Xapian's reopen does
+	   that check itself and is cheap when nothing has changed. */
+	status = notmuch_database_reopen(database->db,
+					 NOTMUCH_DATABASE_MODE_READ_ONLY);
+	if (status != NOTMUCH_STATUS_SUCCESS) {
+		/* try a full reopen with the next lookup */
+		i_error("fts_notmuch: notmuch_database_reopen(%s) failed: %s",
+			database->path, notmuch_status_to_string(status));
+		fts_backend_notmuch_close(backend);
+	}
 	return 0;
 }
 
-static int fts_backend_notmuch_rescan(struct fts_backend *backend)
+static void notmuch_rescan_add_filename(const char *path, void *context)
 {
-	return 0;
+	ARRAY_TYPE(const_string) *paths = context;
+
+	path = t_strdup(path);
+	array_append(paths, &path, 1);
 }
 
-static int fts_backend_notmuch_optimize(struct fts_backend *backend ATTR_UNUSED)
+static int
+notmuch_rescan_mailbox(struct notmuch_fts_backend_update_context *ctx,
+		       struct mailbox *box)
 {
-	return 0;
+	struct notmuch_fts_backend *backend =
+		(struct notmuch_fts_backend *)ctx->ctx.backend;
+	struct notmuch_uidmap *uidmap;
+	struct mailbox_status status;
+	ARRAY_TYPE(const_string) paths, extra_paths;
+	ARRAY_TYPE(seq_range) missing_uids;
+	const struct seq_range *range;
+	const char *const *pathp, *terms, *path;
+	struct stat st;
+	enum mail_error error;
+	const char *errstr;
+	uint32_t last_uid;
+	unsigned int removed = 0;
+
+	if (mailbox_open(box) < 0 ||
+	    mailbox_sync(box, 0) < 0) {
+		errstr = mailbox_get_last_error(box, &error);
+		if (error == MAIL_ERROR_NOTFOUND)
+			return 0;
+		i_error("fts_notmuch: Couldn't sync mailbox %s: %s",
+			box->vname, errstr);
+		return -1;
+	}
+	if (notmuch_uidmap_get(backend->uidmaps, box, &uidmap) < 0 ||
+	    notmuch_get_folder_query(backend, box, uidmap, &terms) < 0 ||
+	    fts_backend_notmuch_open(backend) < 0)
+		return -1;
+
+	t_array_init(&paths, 128);
+	if (notmuch_query_filenames(backend->database->db, terms,
+				    notmuch_rescan_add_filename, &paths,
+				    NULL) < 0)
+		return -1;
+
+	t_array_init(&missing_uids, 16);
+	t_array_init(&extra_paths, 16);
+	notmuch_uidmap_diff(uidmap, &paths, &missing_uids, &extra_paths);
+
+	array_foreach(&extra_paths, pathp) {
+		/* the file may have been delivered after the sync */
+		if (stat(*pathp, &st) == 0 || errno != ENOENT)
+			continue;
+		path = p_strdup(ctx->expunge_pool, *pathp);
+		array_append(&ctx->expunged_paths, &path, 1);
+		removed++;
+	}
+
+	/* everything up to the first missing UID is indexed. the rest are
+	   indexed again, which only adds their filenames to the messages
+	   that notmuch already has. */
+	if (array_count(&missing_uids) > 0) {
+		range = array_idx(&missing_uids, 0);
+		last_uid = range->seq1 - 1;
+		i_warning("fts_notmuch: Mailbox %s: %u messages missing from "
+			  "notmuch, reindexing from UID %u", box->vname,
+			  seq_range_count(&missing_uids), range->seq1);
+	} else {
+		mailbox_get_open_status(box, STATUS_UIDNEXT, &status);
+		last_uid = status.uidnext - 1;
+	}
+	if (removed > 0) {
+		i_warning("fts_notmuch: Mailbox %s: Removing %u files of "
+			  "expunged messages from notmuch", box->vname, removed);
+	}
+	return fts_index_set_last_uid(box, last_uid);
+}
+
+static int fts_backend_notmuch_rescan(struct fts_backend *_backend)
+{
+	const enum mailbox_list_iter_flags iter_flags =
+		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
+		MAILBOX_LIST_ITER_RETURN_NO_FLAGS;
+	struct mailbox_list *list = _backend->ns->list;
+	struct fts_backend_update_context *_ctx;
+	struct notmuch_fts_backend_update_context *ctx;
+	struct mailbox_list_iterate_context *iter;
+	const struct mailbox_info *info;
+	struct mailbox *box;
+	int ret = 0;
+
+	_ctx = fts_backend_update_init(_backend);
+	ctx = (struct notmuch_fts_backend_update_context *)_ctx;
+	notmuch_update_init_expunged_paths(ctx);
+
+	iter = mailbox_list_iter_init(list, "*", iter_flags);
+	while ((info = mailbox_list_iter_next(iter)) != NULL) {
+		if ((info->flags &
+		     (MAILBOX_NONEXISTENT | MAILBOX_NOSELECT)) != 0)
+			continue;
+
+		box = mailbox_alloc(list, info->vname, 0);
+		T_BEGIN {
+			if (notmuch_rescan_mailbox(ctx, box) < 0)
+				ret = -1;
+		} T_END;
+		mailbox_free(&box);
+	}
+	if (mailbox_list_iter_deinit(&iter) < 0)
+		ret = -1;
+
+	/* the stale files are removed in a single transaction */
+	if (fts_backend_update_deinit(&_ctx) < 0)
+		ret = -1;
+	return ret;
+}
+
+static int
+notmuch_optimize_expunge_record(struct notmuch_fts_backend *backend,
+				notmuch_database_t *db,
+				const struct fts_expunge_log_read_record *rec,
+				pool_t pool, ARRAY_TYPE(const_string) *paths)
+{
+	struct mailbox *box;
+	enum mail_error error;
+	int ret;
+
+	/* the UIDs' files are long gone from the uidlist by now, so find
+	   the folder's files that no longer belong to any message */
+	box = mailbox_alloc_guid(backend->backend.ns->list,
+				 rec->mailbox_guid, 0);
+	if (mailbox_open(box) < 0) {
+		(void)mailbox_get_last_error(box, &error);
+		/* a deleted mailbox's files are dropped by notmuch new */
+		ret = error == MAIL_ERROR_NOTFOUND ? 0 : -1;
+	} else {
+		ret = notmuch_expunge_reconcile(backend, db, box, pool, paths);
+	}
+	mailbox_free(&box);
+	return ret;
+}
+
+static int fts_backend_notmuch_optimize(struct fts_backend *_backend)
+{
+	struct notmuch_fts_backend *backend =
+		(struct notmuch_fts_backend *)_backend;
+	struct fts_backend_update_context *_ctx;
+	struct notmuch_fts_backend_update_context *ctx;
+	struct fts_expunge_log_read_ctx *log_ctx;
+	const struct fts_expunge_log_read_record *rec;
+	ARRAY(guid_128_t) reconciled_guids;
+	const guid_128_t *guidp;
+	bool found;
+	int ret = 0;
+
+	if (backend->expunge_log == NULL)
+		return 0;
+
+	_ctx = fts_backend_update_init(_backend);
+	ctx = (struct notmuch_fts_backend_update_context *)_ctx;
+	notmuch_update_init_expunged_paths(ctx);
+	i_array_init(&reconciled_guids, 16);
+
+	log_ctx = fts_expunge_log_read_begin(backend->expunge_log);
+	while ((rec = fts_expunge_log_read_next(log_ctx)) != NULL) {
+		/* the log has a record for each expunge transaction, but
+		   reconciling the mailbox once finds all of its files */
+		found = FALSE;
+		array_foreach(&reconciled_guids, guidp) {
+			if (guid_128_equals(*guidp, rec->mailbox_guid)) {
+				found = TRUE;
+				break;
+			}
+		}
+		if (found)
+			continue;
+		array_append(&reconciled_guids, &rec->mailbox_guid, 1);
+
+		if (notmuch_update_begin(ctx) < 0 ||
+		    notmuch_optimize_expunge_record(backend, ctx->db, rec,
+						    ctx->expunge_pool,
+						    &ctx->expunged_paths) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	array_free(&reconciled_guids);
+	if (ret < 0) {
+		/* keep the log for the next try */
+		_ctx->failed = TRUE;
+		(void)fts_expunge_log_read_end(&log_ctx);
+		(void)fts_backend_update_deinit(&_ctx);
+		return -1;
+	}
+	/* remove the files before the log gets unlinked */
+	if (fts_backend_update_deinit(&_ctx) < 0) {
+		(void)fts_expunge_log_read_end(&log_ctx);
+		return -1;
+	}
+	return fts_expunge_log_read_end(&log_ctx) < 0 ? -1 : 0;
+}
+
+static void notmuch_get_time(struct timeval *tv_r)
+{
+	if (gettimeofday(tv_r, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
 }
 
 static int
-notmuch_search(const struct mailbox *box, const char *terms,
-               ARRAY_TYPE(seq_range) *uids)
+notmuch_query_filenames(notmuch_database_t *db, const char *terms,
+			notmuch_filename_callback_t *callback, void *context,
+			struct notmuch_fts_lookup_stats *stats)
 {
-	notmuch_database_t *notmuch;
 	notmuch_query_t *query;
 	notmuch_message_t *message;
 	notmuch_messages_t *messages;
 	notmuch_filenames_t *filenames;
-	uint32_t uid;
+	notmuch_status_t status;
+	struct timeval start_time, resolve_start, resolve_end;
+	long long resolve_usecs = 0;
+	unsigned int count = 0;
 
-/*
-	if (notmuch_database_open(notmuch_config_get_database_path("/home/jwm/.maildir"),
-	                          NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch))
-		return -1;
-*/
-	if (notmuch_database_open("/home/jwm/.maildir",
-	                          NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch))
-		return -1;
+	if (stats != NULL)
+		notmuch_get_time(&start_time);
 
-	query = notmuch_query_create(notmuch, terms);
+	query = notmuch_query_create(db, terms);
 	if (query == NULL) {
 		return -1;
 	}
+	/* the results are merged into UID ranges, so don't bother sorting */
+	notmuch_query_set_sort(query, NOTMUCH_SORT_UNSORTED);
 
-	messages = notmuch_query_search_messages(query);
-	if (messages == NULL) {
+	status = notmuch_query_search_messages(query, &messages);
+	if (status != NOTMUCH_STATUS_SUCCESS) {
+		i_error("fts_notmuch: notmuch_query_search_messages(%s) failed: %s",
+			terms, notmuch_status_to_string(status));
+		notmuch_query_destroy(query);
 		return -1;
 	}
 
@@ -160,90 +975,506 @@ notmuch_search(const struct mailbox *box, const char *terms,
 	     notmuch_messages_move_to_next(messages))
 	{
 		message = notmuch_messages_get(messages);
+		count++;
 
+		if (stats != NULL)
+			notmuch_get_time(&resolve_start);
 		filenames = notmuch_message_get_filenames(message);
 		for (;
 		     notmuch_filenames_valid(filenames);
 		     notmuch_filenames_move_to_next(filenames))
-		{
-/*
-			maildir_uidlist_get_uid(box->uidlist,
-				notmuch_filenames_get(filenames), &uid);
-*/
-			uid = 69;
-			syslog(LOG_INFO, "got uid %u", uid);
-			seq_range_array_add(uids, 1, uid);
-		}
+			callback(notmuch_filenames_get(filenames), context);
 		notmuch_filenames_destroy(filenames);
+		if (stats != NULL) {
+			notmuch_get_time(&resolve_end);
+			resolve_usecs += timeval_diff_usecs(&resolve_end,
+							    &resolve_start);
+		}
 
 		notmuch_message_destroy(message);
 	}
 
 	notmuch_messages_destroy(messages);
 	notmuch_query_destroy(query);
-	notmuch_database_destroy(notmuch);
+
+	if (stats != NULL) {
+		notmuch_get_time(&resolve_end);
+		stats->queries++;
+		stats->messages += count;
+		stats->query_usecs += timeval_diff_usecs(&resolve_end,
+							 &start_time) -
+			resolve_usecs;
+		stats->resolve_usecs += resolve_usecs;
+	}
 	return 0;
 }
 
+struct notmuch_search_context {
+	struct notmuch_uidmap *uidmap;
+	ARRAY_TYPE(seq_range) *uids;
+};
+
+static void notmuch_search_add_filename(const char *path, void *context)
+{
+	struct notmuch_search_context *ctx = context;
+	uint32_t uid;
+
+	/* the same message may also exist in other mailboxes,
+	   which are skipped here */
+	if (!notmuch_uidmap_lookup(ctx->uidmap, path, &uid))
+		return;
+	seq_range_array_add(ctx->uids, uid);
+}
+
 static int
-fts_backend_notmuch_lookup(struct fts_backend *_backend, struct mailbox *box,
-			struct mail_search_arg *args, bool and_args,
-			struct fts_result *result)
+notmuch_search(struct notmuch_fts_backend *backend,
+	       struct mailbox *box, const char *terms,
+	       ARRAY_TYPE(seq_range) *uids)
 {
-	struct mailbox_status status;
-	string_t *str;
-	const char *box_guid;
-	unsigned int prefix_len;
-	uint32_t item;
+	struct notmuch_search_context ctx;
 
-	if (fts_mailbox_get_guid(box, &box_guid) < 0)
+	memset(&ctx, 0, sizeof(ctx));
+	if (notmuch_uidmap_get(backend->uidmaps, box, &ctx.uidmap) < 0)
 		return -1;
-	mailbox_get_open_status(box, STATUS_UIDNEXT, &status);
-
-	openlog("dovecot-notmuch", LOG_PID, LOG_DAEMON);
-	syslog(LOG_INFO, "adding uid 42");
-/*	sleep(15);*/
-    seq_range_array_add(&result->definite_uids, 1, 42);
-/*    item = 42;
-    array_append_i(&result->definite_uids, &item, 1);*/
-    item = 500;
-/*    array_append_i(&result->scores, &item, 1);*/
-/*    result->scores_sorted = TRUE;*/
-    args->match_always = TRUE;
-/*
-	if (notmuch_search(box, "FIXME", &result->definite_uids) < 0)
+	ctx.uids = uids;
+
+	if (fts_backend_notmuch_open(backend) < 0)
 		return -1;
-*/
+	return notmuch_query_filenames(backend->database->db, terms,
+				       notmuch_search_add_filename, &ctx,
+				       backend->debug ? &backend->stats : NULL);
+}
+
+static bool notmuch_date_arg_is_exact(const struct mail_search_arg *arg)
+{
+	/* notmuch only knows the Date: header's UTC timestamp. Without
+	   USE_TZ the comparisons are done using the sender's local date,
+	   which notmuch can't answer. */
+	return arg->value.date_type == MAIL_SEARCH_DATE_TYPE_SENT &&
+		(arg->value.search_flags & MAIL_SEARCH_ARG_FLAG_USE_TZ) != 0;
+}
+
+static void
+notmuch_add_date_query(string_t *str, const struct mail_search_arg *arg)
+{
+	/* date:<since>..<until> range is inclusive */
+	str_append(str, "date:");
+	switch (arg->type) {
+	case SEARCH_BEFORE:
+		str_printfa(str, "..@%ld", (long)arg->value.time - 1);
+		break;
+	case SEARCH_ON:
+		str_printfa(str, "@%ld..@%ld", (long)arg->value.time,
+			    (long)arg->value.time + 3600*24 - 1);
+		break;
+	case SEARCH_SINCE:
+		str_printfa(str, "@%ld..", (long)arg->value.time);
+		break;
+	default:
+		i_unreached();
+	}
+}
+
+static const char *notmuch_header_prefix(const char *hdr_name)
+{
+	if (strcasecmp(hdr_name, "From") == 0)
+		return "from:";
+	if (strcasecmp(hdr_name, "Subject") == 0)
+		return "subject:";
+	return NULL;
+}
+
+static bool
+notmuch_add_definite_query(string_t *str, struct mail_search_arg *arg)
+{
+	const char *prefix = NULL;
+
+	switch (arg->type) {
+	case SEARCH_TEXT:
+		break;
+	case SEARCH_BODY:
+		prefix = "body:";
+		break;
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_ADDRESS:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+		prefix = notmuch_header_prefix(arg->hdr_field_name);
+		if (prefix == NULL)
+			return FALSE;
+		break;
+	case SEARCH_BEFORE:
+	case SEARCH_ON:
+	case SEARCH_SINCE:
+		if (!notmuch_date_arg_is_exact(arg))
+			return FALSE;
+		if (arg->match_not)
+			str_append(str, "(NOT ");
+		notmuch_add_date_query(str, arg);
+		if (arg->match_not)
+			str_append_c(str, ')');
+		return TRUE;
+	default:
+		return FALSE;
+	}
+	if (*arg->value.str == '\0')
+		return FALSE;
+
+	if (arg->match_not)
+		str_append(str, "(NOT ");
+	if (prefix != NULL)
+		str_append(str, prefix);
+	notmuch_quote_term(str, arg->value.str);
+	if (arg->match_not)
+		str_append_c(str, ')');
+	return TRUE;
+}
+
+static bool
+notmuch_add_definite_query_args(string_t *str, struct mail_search_arg *arg,
+				bool and_args)
+{
+	unsigned int last_len;
+
+	last_len = str_len(str);
+	for (; arg != NULL; arg = arg->next) {
+		if (notmuch_add_definite_query(str, arg)) {
+			arg->match_always = TRUE;
+			last_len = str_len(str);
+			if (and_args)
+				str_append(str, " AND ");
+			else
+				str_append(str, " OR ");
+		}
+	}
+	if (str_len(str) == last_len)
+		return FALSE;
+
+	str_truncate(str, last_len);
+	return TRUE;
+}
+
+static bool
+notmuch_add_maybe_query(string_t *str, struct mail_search_arg *arg)
+{
+	switch (arg->type) {
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_ADDRESS:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+		if (notmuch_header_prefix(arg->hdr_field_name) != NULL)
+			return FALSE;
+		if (arg->match_not || *arg->value.str == '\0') {
+			/* all matches would be definite, but all non-matches
+			   would be maybies. too much trouble to optimize. */
+			return FALSE;
+		}
+		/* notmuch's to: matches all of To, Cc and Bcc, so it can
+		   be used to filter out messages with no chance of
+		   matching */
+		if (strcasecmp(arg->hdr_field_name, "To") != 0 &&
+		    strcasecmp(arg->hdr_field_name, "Cc") != 0 &&
+		    strcasecmp(arg->hdr_field_name, "Bcc") != 0)
+			return FALSE;
+		str_append(str, "to:");
+		notmuch_quote_term(str, arg->value.str);
+		break;
+	default:
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static bool
+notmuch_add_maybe_query_args(string_t *str, struct mail_search_arg *arg,
+			     bool and_args)
+{
+	unsigned int last_len;
+
+	last_len = str_len(str);
+	for (; arg != NULL; arg = arg->next) {
+		if (notmuch_add_maybe_query(str, arg)) {
+			arg->match_always = TRUE;
+			last_len = str_len(str);
+			if (and_args)
+				str_append(str, " AND ");
+			else
+				str_append(str, " OR ");
+		}
+	}
+	if (str_len(str) == last_len)
+		return FALSE;
+
+	str_truncate(str, last_len);
+	return TRUE;
+}
+
+static unsigned int
+notmuch_get_definite_queries(struct mail_search_arg *args,
+			     enum fts_lookup_flags flags,
+			     ARRAY_TYPE(const_string) *queries)
+{
+	bool and_args = (flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0;
+	const char *query;
+	string_t *str;
+
+	/* notmuch searches Xapian with boolean weighting, so there is no
+	   match weight to use for scoring. When scores are wanted, an OR
+	   list is instead looked up one arg at a time, so that each message
+	   can be scored by how many of the args it matched. */
+	if (and_args || (flags & FTS_LOOKUP_FLAG_SCORES) == 0) {
+		str = t_str_new(256);
+		if (notmuch_add_definite_query_args(str, args, and_args)) {
+			query = str_c(str);
+			array_append(queries, &query, 1);
+		}
+		return array_count(queries);
+	}
+	for (; args != NULL; args = args->next) {
+		str = t_str_new(128);
+		if (notmuch_add_definite_query(str, args)) {
+			args->match_always = TRUE;
+			query = str_c(str);
+			array_append(queries, &query, 1);
+		}
+	}
+	return array_count(queries);
+}
+
+static void
+notmuch_add_scores(ARRAY_TYPE(fts_score_map) *scores,
+		   const ARRAY_TYPE(seq_range) *uids,
+		   const ARRAY_TYPE(seq_range) arg_uids[], unsigned int count)
+{
+	struct seq_range_iter iter;
+	struct fts_score_map *score;
+	unsigned int i, n = 0, matches;
+	uint32_t uid;
+
+	/* scores are added in UID order */
+	seq_range_array_iter_init(&iter, uids);
+	while (seq_range_array_iter_nth(&iter, n++, &uid)) {
+		matches = 0;
+		for (i = 0; i < count; i++) {
+			if (seq_range_exists(&arg_uids[i], uid))
+				matches++;
+		}
+		score = array_append_space(scores);
+		score->uid = uid;
+		score->score = (float)matches / count;
+	}
+}
+
+static int
+fts_backend_notmuch_lookup(struct fts_backend *_backend, struct mailbox *box,
+			   struct mail_search_arg *args,
+			   enum fts_lookup_flags flags,
+			   struct fts_result *result)
+{
+	struct notmuch_fts_backend *backend =
+		(struct notmuch_fts_backend *)_backend;
+	bool and_args = (flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0;
+	ARRAY_TYPE(const_string) queries;
+	ARRAY_TYPE(seq_range) definite_uids, *arg_uids;
+	const char *const *query;
+	unsigned int i, count;
+	string_t *str;
+
+	/* SEARCH_OR and SEARCH_SUB args are looked up separately by the
+	   caller, so each level is a flat list of args joined with either
+	   AND or OR. */
+	t_array_init(&queries, 8);
+	count = notmuch_get_definite_queries(args, flags, &queries);
+	if (count > 0) {
+		ARRAY_TYPE(seq_range) *uids_arr =
+			(flags & FTS_LOOKUP_FLAG_NO_AUTO_FUZZY) == 0 ?
+			&result->definite_uids : &result->maybe_uids;
+
+		t_array_init(&definite_uids, 128);
+		arg_uids = t_new(ARRAY_TYPE(seq_range), count);
+		for (i = 0; i < count; i++) {
+			query = array_idx(&queries, i);
+			if (backend->debug)
+				i_debug("fts_notmuch: Lookup: %s", *query);
+			t_array_init(&arg_uids[i], 32);
+			if (notmuch_search(backend, box, *query, &arg_uids[i]) < 0)
+				return -1;
+			seq_range_array_merge(&definite_uids, &arg_uids[i]);
+		}
+		seq_range_array_merge(uids_arr, &definite_uids);
+		if ((flags & FTS_LOOKUP_FLAG_SCORES) != 0) {
+			notmuch_add_scores(&result->scores, &definite_uids,
+					   arg_uids, count);
+		}
+	}
+	result->scores_sorted = TRUE;
+
+	str = t_str_new(256);
+	if (notmuch_add_maybe_query_args(str, args, and_args)) {
+		if (notmuch_search(backend, box, str_c(str),
+				   &result->maybe_uids) < 0)
+			return -1;
+	}
 	return 0;
 }
 
+struct notmuch_multi_box {
+	struct notmuch_uidmap *uidmap;
+	struct fts_result *result;
+	/* UIDs matching each of the queries */
+	ARRAY_TYPE(seq_range) *query_uids;
+};
+
+struct notmuch_search_multi_context {
+	/* mailbox path -> box */
+	HASH_TABLE(const char *, struct notmuch_multi_box *) boxes;
+	unsigned int query_idx;
+};
+
+static void notmuch_search_multi_add_filename(const char *path, void *context)
+{
+	struct notmuch_search_multi_context *ctx = context;
+	struct notmuch_multi_box *mbox;
+	const char *p;
+	uint32_t uid;
+
+	/* path is <mailbox path>/{cur,new}/<filename> */
+	p = strrchr(path, '/');
+	if (p == NULL || p - path < 4 ||
+	    (strncmp(p - 4, "/cur", 4) != 0 && strncmp(p - 4, "/new", 4) != 0))
+		return;
+
+	T_BEGIN {
+		mbox = hash_table_lookup(ctx->boxes,
+					 t_strdup_until(path, p - 4));
+	} T_END;
+	if (mbox == NULL || !notmuch_uidmap_lookup(mbox->uidmap, path, &uid))
+		return;
+
+	seq_range_array_add(&mbox->query_uids[ctx->query_idx], uid);
+}
+
+static void
+notmuch_search_multi_finish(struct notmuch_multi_box *mbox,
+			    unsigned int query_count,
+			    enum fts_lookup_flags flags, pool_t pool)
+{
+	struct fts_result *result = mbox->result;
+	ARRAY_TYPE(seq_range) definite_uids, *uids_arr;
+	unsigned int i;
+
+	t_array_init(&definite_uids, 128);
+	for (i = 0; i < query_count; i++)
+		seq_range_array_merge(&definite_uids, &mbox->query_uids[i]);
+	if (array_count(&definite_uids) == 0)
+		return;
+
+	uids_arr = (flags & FTS_LOOKUP_FLAG_NO_AUTO_FUZZY) == 0 ?
+		&result->definite_uids : &result->maybe_uids;
+	p_array_init(uids_arr, pool, array_count(&definite_uids));
+	array_append_array(uids_arr, &definite_uids);
+
+	if ((flags & FTS_LOOKUP_FLAG_SCORES) != 0) {
+		p_array_init(&result->scores, pool, 32);
+		notmuch_add_scores(&result->scores, &definite_uids,
+				   mbox->query_uids, query_count);
+		result->scores_sorted = TRUE;
+	}
+}
+
 static int
-notmuch_search_multi(struct fts_backend *_backend, string_t *str,
-		  struct mailbox *const boxes[],
-		  struct fts_multi_result *result)
-{
-/*
-	p_array_init(&fts_results, result->pool, 32);
-	for (i = 0; notmuch_results[i] != NULL; i++) {
-		fts_result = array_append_space(&fts_results);
-		fts_result->box = box;
-		fts_result->definite_uids = notmuch_results[i]->uids;
-	}
-	(void)array_append_space(&fts_results);
+notmuch_search_multi(struct notmuch_fts_backend *backend,
+		     const ARRAY_TYPE(const_string) *queries,
+		     struct mailbox *const boxes[], enum fts_lookup_flags flags,
+		     struct fts_multi_result *result)
+{
+	struct notmuch_search_multi_context ctx;
+	ARRAY(struct fts_result) fts_results;
+	struct notmuch_multi_box *mboxes;
+	const char *const *query;
+	unsigned int i, j, count, query_count = array_count(queries);
+	int ret = 0;
+
+	for (count = 0; boxes[count] != NULL; count++) ;
+
+	memset(&ctx, 0, sizeof(ctx));
+	hash_table_create(&ctx.boxes, default_pool, count, str_hash, strcmp);
+
+	/* the result array must not grow after pointers to it are taken */
+	p_array_init(&fts_results, result->pool, count + 1);
+	mboxes = t_new(struct notmuch_multi_box, count);
+	for (i = 0; i < count; i++) {
+		if (notmuch_uidmap_get(backend->uidmaps, boxes[i],
+				       &mboxes[i].uidmap) < 0) {
+			ret = -1;
+			break;
+		}
+		mboxes[i].result = array_append_space(&fts_results);
+		mboxes[i].result->box = boxes[i];
+		mboxes[i].query_uids =
+			t_new(ARRAY_TYPE(seq_range), query_count);
+		for (j = 0; j < query_count; j++)
+			t_array_init(&mboxes[i].query_uids[j], 32);
+		hash_table_insert(ctx.boxes,
+				  notmuch_uidmap_get_path(mboxes[i].uidmap),
+				  &mboxes[i]);
+	}
+
+	/* each query is done only once for all the mailboxes, and its
+	   results are then split by the folder that each file is in */
+	if (ret == 0)
+		ret = fts_backend_notmuch_open(backend);
+	for (i = 0; i < query_count && ret == 0; i++) {
+		query = array_idx(queries, i);
+		ctx.query_idx = i;
+		if (backend->debug)
+			i_debug("fts_notmuch: Lookup: %s", *query);
+		ret = notmuch_query_filenames(backend->database->db, *query,
+			notmuch_search_multi_add_filename, &ctx,
+			backend->debug ? &backend->stats : NULL);
+	}
+	hash_table_destroy(&ctx.boxes);
+	if (ret < 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		notmuch_search_multi_finish(&mboxes[i], query_count,
+					    flags, result->pool);
+	}
+	array_append_zero(&fts_results);
 	result->box_results = array_idx_modifiable(&fts_results, 0);
-	hash_table_destroy(&mailboxes);
-*/
 	return 0;
 }
 
 static int
-fts_backend_notmuch_lookup_multi(struct fts_backend *backend,
-                  struct mailbox *const boxes[],
-                  struct mail_search_arg *args, bool and_args,
-                  struct fts_multi_result *result)
+fts_backend_notmuch_lookup_multi(struct fts_backend *_backend,
+				 struct mailbox *const boxes[],
+				 struct mail_search_arg *args,
+				 enum fts_lookup_flags flags,
+				 struct fts_multi_result *result)
 {
-	/* FIXME */
-	return 0;
+	struct notmuch_fts_backend *backend =
+		(struct notmuch_fts_backend *)_backend;
+	ARRAY_TYPE(const_string) queries;
+
+	t_array_init(&queries, 8);
+	if (notmuch_get_definite_queries(args, flags, &queries) == 0)
+		return 0;
+	return notmuch_search_multi(backend, &queries, boxes, flags, result);
+}
+
+static void fts_backend_notmuch_lookup_done(struct fts_backend *_backend)
+{
+	struct notmuch_fts_backend *backend =
+		(struct notmuch_fts_backend *)_backend;
+	struct notmuch_fts_lookup_stats *stats = &backend->stats;
+
+	if (stats->queries == 0)
+		return;
+
+	i_debug("fts_notmuch: %u queries found %u messages in %lld ms, "
+		"resolving them to UIDs took %lld ms", stats->queries,
+		stats->messages, stats->query_usecs/1000,
+		stats->resolve_usecs/1000);
+	memset(stats, 0, sizeof(*stats));
 }
 
 struct fts_backend fts_backend_notmuch = {
@@ -268,6 +1499,6 @@ struct fts_backend fts_backend_notmuch = {
 		fts_backend_default_can_lookup,
 		fts_backend_notmuch_lookup,
 		fts_backend_notmuch_lookup_multi,
-		NULL
+		fts_backend_notmuch_lookup_done
 	}
 };
@@ -3,6 +3,8 @@
 
 #include "lib.h"
 #include "array.h"
+#include "str.h"
+#include "var-expand.h"
 #include "mail-user.h"
 #include "mail-storage-hooks.h"
 #include "fts-notmuch-plugin.h"
@@ -19,13 +21,21 @@ fts_notmuch_plugin_init_settings(struct mail_user *user,
 			      struct fts_notmuch_settings *set, const char *str)
 {
 	const char *const *tmp;
+	string_t *path;
 
 	if (str == NULL)
 		str = "";
 
 	for (tmp = t_strsplit_spaces(str, " "); *tmp != NULL; tmp++) {
-		if (strcmp(*tmp, "debug") == 0) {
+		if (strncmp(*tmp, "path=", 5) == 0) {
+			path = t_str_new(256);
+			var_expand(path, *tmp + 5,
+				   mail_user_var_expand_table(user));
+			set->path = p_strdup(user->pool, str_c(path));
+		} else if (strcmp(*tmp, "debug") == 0) {
 			set->debug = TRUE;
+		} else if (strcmp(*tmp, "lazy_expunge") == 0) {
+			set->lazy_expunge = TRUE;
 		} else {
 			i_error("fts_notmuch: Invalid setting: %s", *tmp);
 			return -1;
@@ -34,14 +44,35 @@ fts_notmuch_plugin_init_settings(struct mail_user *user,
 	return 0;
 }
 
+static void fts_notmuch_mail_user_created(struct mail_user *user)
+{
+	struct fts_notmuch_user *fuser;
+	const char *env;
+
+	fuser = p_new(user->pool, struct fts_notmuch_user, 1);
+	env = mail_user_plugin_getenv(user, "fts_notmuch");
+	if (fts_notmuch_plugin_init_settings(user, &fuser->set, env) < 0) {
+		/* invalid settings, disabling */
+		return;
+	}
+
+	MODULE_CONTEXT_SET(user, fts_notmuch_user_module, fuser);
+}
+
+static struct mail_storage_hooks fts_notmuch_mail_storage_hooks = {
+	.mail_user_created = fts_notmuch_mail_user_created
+};
+
 void fts_notmuch_plugin_init(struct module *module)
 {
 	fts_backend_register(&fts_backend_notmuch);
+	mail_storage_hooks_add(module, &fts_notmuch_mail_storage_hooks);
 }
 
 void fts_notmuch_plugin_deinit(void)
 {
 	fts_backend_unregister(fts_backend_notmuch.name);
+	mail_storage_hooks_remove(&fts_notmuch_mail_storage_hooks);
 }
 
 const char *fts_notmuch_plugin_dependencies[] = { "fts", NULL };
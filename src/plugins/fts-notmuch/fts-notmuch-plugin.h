@@ -1,19 +1,24 @@
-#ifndef FTS_SOLR_PLUGIN_H
-#define FTS_SOLR_PLUGIN_H
+#ifndef FTS_NOTMUCH_PLUGIN_H
+#define FTS_NOTMUCH_PLUGIN_H
 
 #include "module-context.h"
 #include "fts-api-private.h"
 
-#define FTS_SOLR_USER_CONTEXT(obj) \
+#define FTS_NOTMUCH_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_notmuch_user_module)
 
 struct fts_notmuch_settings {
+	const char *path;
 	bool debug;
+	bool lazy_expunge;
 };
 
 struct fts_notmuch_user {
 	union mail_user_module_context module_ctx;
 	struct fts_notmuch_settings set;
+
+	/* databases opened by the user's namespaces */
+	ARRAY(struct notmuch_fts_database *) databases;
 };
 
 extern const char *fts_notmuch_plugin_dependencies[];
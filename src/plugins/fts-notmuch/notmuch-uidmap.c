@@ -0,0 +1,293 @@
+/* Copyright (c) 2014 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "mail-storage-private.h"
+#include "maildir-storage.h"
+#include "maildir-uidlist.h"
+#include "maildir-filename.h"
+#include "fts-api-private.h"
+#include "notmuch-uidmap.h"
+
+struct notmuch_uidmap_rec {
+	uint32_t uid;
+	bool new_dir;
+	const char *fname;
+};
+
+struct notmuch_uidmap {
+	char *box_guid;
+	char *path;
+	unsigned int path_len;
+
+	/* base filename -> UID */
+	pool_t pool;
+	HASH_TABLE(char *, void *) uids;
+	/* records sorted by UID */
+	ARRAY(struct notmuch_uidmap_rec) recs;
+
+	/* the uidlist state that the map was built from */
+	struct maildir_uidlist *uidlist;
+	unsigned int change_counter;
+	uint32_t uid_validity, next_uid;
+};
+
+struct notmuch_uidmaps {
+	/* mailbox GUID -> map */
+	HASH_TABLE(char *, struct notmuch_uidmap *) maps;
+};
+
+struct notmuch_uidmaps *notmuch_uidmaps_init(void)
+{
+	struct notmuch_uidmaps *maps;
+
+	maps = i_new(struct notmuch_uidmaps, 1);
+	hash_table_create(&maps->maps, default_pool, 0, str_hash, strcmp);
+	return maps;
+}
+
+static void notmuch_uidmap_free(struct notmuch_uidmap *map)
+{
+	hash_table_destroy(&map->uids);
+	array_free(&map->recs);
+	pool_unref(&map->pool);
+	i_free(map->box_guid);
+	i_free(map->path);
+	i_free(map);
+}
+
+void notmuch_uidmaps_deinit(struct notmuch_uidmaps **_maps)
+{
+	struct notmuch_uidmaps *maps = *_maps;
+	struct hash_iterate_context *iter;
+	struct notmuch_uidmap *map;
+	char *guid;
+
+	*_maps = NULL;
+
+	iter = hash_table_iterate_init(maps->maps);
+	while (hash_table_iterate(iter, maps->maps, &guid, &map))
+		notmuch_uidmap_free(map);
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&maps->maps);
+	i_free(maps);
+}
+
+static bool
+notmuch_uidmap_is_valid(struct notmuch_uidmap *map,
+			struct maildir_uidlist *uidlist)
+{
+	return map->uidlist == uidlist &&
+		map->change_counter ==
+			maildir_uidlist_get_change_counter(uidlist) &&
+		map->uid_validity == maildir_uidlist_get_uid_validity(uidlist) &&
+		map->next_uid == maildir_uidlist_get_next_uid(uidlist);
+}
+
+static void
+notmuch_uidmap_build(struct notmuch_uidmap *map,
+		     struct maildir_uidlist *uidlist)
+{
+	struct maildir_uidlist_iter_ctx *iter;
+	enum maildir_uidlist_rec_flag flags;
+	struct notmuch_uidmap_rec *rec;
+	const char *fname;
+	uint32_t uid;
+
+	hash_table_clear(map->uids, TRUE);
+	array_clear(&map->recs);
+	p_clear(map->pool);
+
+	iter = maildir_uidlist_iter_init(uidlist);
+	while (maildir_uidlist_iter_next(iter, &uid, &flags, &fname)) {
+		rec = array_append_space(&map->recs);
+		rec->uid = uid;
+		rec->new_dir = (flags & MAILDIR_UIDLIST_REC_FLAG_NEW_DIR) != 0;
+		rec->fname = p_strdup(map->pool, fname);
+		hash_table_update(map->uids, (char *)rec->fname,
+				  POINTER_CAST(uid));
+	}
+	maildir_uidlist_iter_deinit(&iter);
+
+	map->uidlist = uidlist;
+	map->change_counter = maildir_uidlist_get_change_counter(uidlist);
+	map->uid_validity = maildir_uidlist_get_uid_validity(uidlist);
+	map->next_uid = maildir_uidlist_get_next_uid(uidlist);
+}
+
+int notmuch_uidmap_get(struct notmuch_uidmaps *maps, struct mailbox *box,
+		       struct notmuch_uidmap **map_r)
+{
+	struct maildir_mailbox *mbox = (struct maildir_mailbox *)box;
+	struct notmuch_uidmap *map;
+	const char *guid;
+
+	if (strcmp(box->storage->name, MAILDIR_STORAGE_NAME) != 0) {
+		i_error("fts_notmuch: Mailbox %s isn't in maildir format",
+			box->vname);
+		return -1;
+	}
+	if (fts_mailbox_get_guid(box, &guid) < 0)
+		return -1;
+
+	if (maildir_uidlist_refresh(mbox->uidlist) < 0)
+		return -1;
+
+	map = hash_table_lookup(maps->maps, guid);
+	if (map == NULL) {
+		map = i_new(struct notmuch_uidmap, 1);
+		map->box_guid = i_strdup(guid);
+		map->pool = pool_alloconly_create("notmuch uidmap", 1024*16);
+		hash_table_create(&map->uids, default_pool, 0,
+				  maildir_filename_base_hash,
+				  maildir_filename_base_cmp);
+		i_array_init(&map->recs, 128);
+		hash_table_insert(maps->maps, map->box_guid, map);
+	}
+	if (map->path == NULL || strcmp(map->path, mailbox_get_path(box)) != 0) {
+		i_free(map->path);
+		map->path = i_strdup(mailbox_get_path(box));
+		map->path_len = strlen(map->path);
+	}
+	if (!notmuch_uidmap_is_valid(map, mbox->uidlist))
+		notmuch_uidmap_build(map, mbox->uidlist);
+
+	*map_r = map;
+	return 0;
+}
+
+struct notmuch_uidmap *
+notmuch_uidmap_get_cached(struct notmuch_uidmaps *maps, const char *box_guid)
+{
+	return hash_table_lookup(maps->maps, box_guid);
+}
+
+const char *notmuch_uidmap_get_path(struct notmuch_uidmap *map)
+{
+	return map->path;
+}
+
+bool notmuch_uidmap_path_in_mailbox(struct notmuch_uidmap *map,
+				    const char *path)
+{
+	const char *fname;
+
+	/* path must be <mailbox path>/{cur,new}/<filename> */
+	if (strncmp(path, map->path, map->path_len) != 0)
+		return FALSE;
+	path += map->path_len;
+	if (strncmp(path, "/cur/", 5) != 0 && strncmp(path, "/new/", 5) != 0)
+		return FALSE;
+	fname = path + 5;
+	return *fname != '\0' && strchr(fname, '/') == NULL;
+}
+
+bool notmuch_uidmap_lookup(struct notmuch_uidmap *map, const char *path,
+			   uint32_t *uid_r)
+{
+	void *value;
+
+	if (!notmuch_uidmap_path_in_mailbox(map, path))
+		return FALSE;
+
+	value = hash_table_lookup(map->uids, path + map->path_len + 5);
+	if (value == NULL)
+		return FALSE;
+	*uid_r = POINTER_CAST_TO(value, uint32_t);
+	return TRUE;
+}
+
+static int notmuch_uidmap_rec_cmp(const uint32_t *uid,
+				  const struct notmuch_uidmap_rec *rec)
+{
+	return *uid < rec->uid ? -1 :
+		(*uid > rec->uid ? 1 : 0);
+}
+
+const char *notmuch_uidmap_get_uid_fname(struct notmuch_uidmap *map,
+					 uint32_t uid)
+{
+	const struct notmuch_uidmap_rec *rec;
+
+	rec = array_bsearch(&map->recs, &uid, notmuch_uidmap_rec_cmp);
+	return rec == NULL ? NULL : rec->fname;
+}
+
+const char *notmuch_uidmap_path_get_fname(struct notmuch_uidmap *map,
+					  const char *path)
+{
+	if (!notmuch_uidmap_path_in_mailbox(map, path))
+		return NULL;
+	return path + map->path_len + 5;
+}
+
+static int
+notmuch_uidmap_rec_fname_cmp(const struct notmuch_uidmap_rec *const *rec1,
+			     const struct notmuch_uidmap_rec *const *rec2)
+{
+	return maildir_filename_base_cmp((*rec1)->fname, (*rec2)->fname);
+}
+
+static int notmuch_fname_cmp(const char *const *fname1,
+			     const char *const *fname2)
+{
+	return maildir_filename_base_cmp(*fname1, *fname2);
+}
+
+void notmuch_uidmap_diff(struct notmuch_uidmap *map,
+			 const ARRAY_TYPE(const_string) *paths,
+			 ARRAY_TYPE(seq_range) *missing_uids,
+			 ARRAY_TYPE(const_string) *extra_paths)
+{
+	ARRAY(const struct notmuch_uidmap_rec *) sorted_recs;
+	ARRAY_TYPE(const_string) fnames;
+	const struct notmuch_uidmap_rec *rec, *const *recs;
+	const char *const *pathp, *const *names, *path;
+	unsigned int i, j, rec_count, fname_count;
+	int ret;
+
+	/* the base filenames point to the paths after
+	   "<mailbox path>/{cur,new}/" */
+	t_array_init(&fnames, array_count(paths) + 1);
+	array_foreach(paths, pathp) {
+		if (notmuch_uidmap_path_in_mailbox(map, *pathp)) {
+			path = *pathp + map->path_len + 5;
+			array_append(&fnames, &path, 1);
+		}
+	}
+	array_sort(&fnames, notmuch_fname_cmp);
+
+	t_array_init(&sorted_recs, array_count(&map->recs) + 1);
+	array_foreach(&map->recs, rec)
+		array_append(&sorted_recs, &rec, 1);
+	array_sort(&sorted_recs, notmuch_uidmap_rec_fname_cmp);
+
+	recs = array_get(&sorted_recs, &rec_count);
+	names = array_get(&fnames, &fname_count);
+	for (i = j = 0; i < rec_count || j < fname_count; ) {
+		if (i == rec_count)
+			ret = 1;
+		else if (j == fname_count)
+			ret = -1;
+		else
+			ret = maildir_filename_base_cmp(recs[i]->fname,
+							names[j]);
+		if (ret < 0) {
+			seq_range_array_add(missing_uids, recs[i]->uid);
+			i++;
+		} else if (ret > 0) {
+			path = names[j] - map->path_len - 5;
+			array_append(extra_paths, &path, 1);
+			j++;
+		} else {
+			/* the file may also exist in both cur/ and new/ */
+			for (j++; j < fname_count; j++) {
+				if (maildir_filename_base_cmp(recs[i]->fname,
+							      names[j]) != 0)
+					break;
+			}
+			i++;
+		}
+	}
+}
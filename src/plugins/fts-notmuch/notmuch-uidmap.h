@@ -0,0 +1,52 @@
+#ifndef NOTMUCH_UIDMAP_H
+#define NOTMUCH_UIDMAP_H
+
+struct mailbox;
+struct notmuch_uidmaps;
+struct notmuch_uidmap;
+
+struct notmuch_uidmaps *notmuch_uidmaps_init(void);
+void notmuch_uidmaps_deinit(struct notmuch_uidmaps **maps);
+
+/* Return filename -> UID map for the given maildir mailbox. The map is
+   rebuilt only if the mailbox's uidlist has changed since the last call.
+   Returns 0 if ok, -1 if error. */
+int notmuch_uidmap_get(struct notmuch_uidmaps *maps, struct mailbox *box,
+		       struct notmuch_uidmap **map_r);
+/* Return the map as it was last built without refreshing it, or NULL if
+   there is none. This is useful for finding the files of already expunged
+   messages. */
+struct notmuch_uidmap *
+notmuch_uidmap_get_cached(struct notmuch_uidmaps *maps, const char *box_guid);
+/* Returns the mailbox's directory path, which all of its messages'
+   filenames begin with. */
+const char *notmuch_uidmap_get_path(struct notmuch_uidmap *map);
+
+/* Returns TRUE if path is a message file in this mailbox's cur/ or new/
+   directory. */
+bool notmuch_uidmap_path_in_mailbox(struct notmuch_uidmap *map,
+				    const char *path);
+/* Look up UID for the full path of a message file, as returned by notmuch.
+   Returns TRUE if found, FALSE if the file doesn't belong to this mailbox
+   or it isn't in the uidlist. */
+bool notmuch_uidmap_lookup(struct notmuch_uidmap *map, const char *path,
+			   uint32_t *uid_r);
+/* Compare the full paths of the mailbox's message files in notmuch against
+   the map using a sorted merge. The UIDs that have no file are added to
+   missing_uids and the paths that have no UID to extra_paths. Paths outside
+   the mailbox are ignored. */
+void notmuch_uidmap_diff(struct notmuch_uidmap *map,
+			 const ARRAY_TYPE(const_string) *paths,
+			 ARRAY_TYPE(seq_range) *missing_uids,
+			 ARRAY_TYPE(const_string) *extra_paths);
+/* Returns the filename of the message with the given UID as it was in the
+   uidlist, or NULL if it's not in the map. The flags part of the filename
+   may have changed since, so compare it with maildir_filename_base_cmp(). */
+const char *notmuch_uidmap_get_uid_fname(struct notmuch_uidmap *map,
+					 uint32_t uid);
+/* Returns the filename part of the full path of a message file in this
+   mailbox, or NULL if the path isn't in the mailbox's cur/ or new/. */
+const char *notmuch_uidmap_path_get_fname(struct notmuch_uidmap *map,
+					  const char *path);
+
+#endif
@@ -236,7 +236,7 @@ fts_backend_solr_init(struct fts_backend *_backend, const char **error_r)
 		*error_r = "Invalid fts_solr setting";
 		return -1;
 	}
-	if (solr_connection_init(fuser->set.url, fuser->set.debug,
+	if (solr_connection_init(fuser->set.url, fuser->set.debug, 0,
 				 &backend->solr_conn, error_r) < 0)
 		return -1;
 
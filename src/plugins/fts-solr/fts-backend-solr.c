@@ -19,6 +19,8 @@
 #define SOLR_CMDBUF_SIZE (1024*64)
 #define SOLR_CMDBUF_FLUSH_SIZE (SOLR_CMDBUF_SIZE-128)
 #define SOLR_MAX_MULTI_ROWS 100000
+/* With max_pending_posts the documents are posted in batches of this size */
+#define SOLR_BATCH_FLUSH_SIZE (1024*1024)
 
 /* If header is larger than this, truncate it. */
 #define SOLR_HEADER_MAX_SIZE (1024*1024)
@@ -50,6 +52,9 @@ struct solr_fts_backend_update_context {
 
 	uint32_t last_indexed_uid;
 
+	/* documents are posted in asynchronous batches instead of one
+	   streamed post */
+	unsigned int batch_posts:1;
 	unsigned int last_indexed_uid_set:1;
 	unsigned int body_open:1;
 	unsigned int documents_added:1;
@@ -166,6 +171,7 @@ fts_backend_solr_init(struct fts_backend *_backend, const char **error_r)
 		return -1;
 	}
 	return solr_connection_init(fuser->set.url, fuser->set.debug,
+				    fuser->set.max_pending_posts,
 				    &backend->solr_conn, error_r);
 }
 
@@ -245,10 +251,12 @@ fts_backend_solr_get_last_uid(struct fts_backend *_backend,
 static struct fts_backend_update_context *
 fts_backend_solr_update_init(struct fts_backend *_backend)
 {
+	struct fts_solr_user *fuser = FTS_SOLR_USER_CONTEXT(_backend->ns->user);
 	struct solr_fts_backend_update_context *ctx;
 
 	ctx = i_new(struct solr_fts_backend_update_context, 1);
 	ctx->ctx.backend = _backend;
+	ctx->batch_posts = fuser->set.max_pending_posts > 0;
 	i_array_init(&ctx->fields, 16);
 	return &ctx->ctx;
 }
@@ -320,9 +328,49 @@ fts_backend_solr_doc_close(struct solr_fts_backend_update_context *ctx)
 	str_append(ctx->cmd, "</doc>");
 }
 
+static int
+fts_backend_solr_batch_post(struct solr_fts_backend_update_context *ctx)
+{
+	struct solr_fts_backend *backend =
+		(struct solr_fts_backend *)ctx->ctx.backend;
+	int ret;
+
+	str_append(ctx->cmd, "</add>");
+	ret = solr_connection_post_async(backend->solr_conn,
+					 str_data(ctx->cmd), str_len(ctx->cmd));
+	str_truncate(ctx->cmd, 0);
+	str_append(ctx->cmd, "<add>");
+	return ret;
+}
+
+static int
+fts_backend_solr_batch_flush(struct solr_fts_backend_update_context *ctx)
+{
+	int ret;
+
+	if (ctx->cmd == NULL)
+		return 0;
+
+	/* the next document starts a new <add> */
+	fts_backend_solr_doc_close(ctx);
+	ret = fts_backend_solr_batch_post(ctx);
+	str_free(&ctx->cmd);
+	return ret;
+}
+
 static int
 fts_backed_solr_build_commit(struct solr_fts_backend_update_context *ctx)
 {
+	struct solr_fts_backend *backend =
+		(struct solr_fts_backend *)ctx->ctx.backend;
+	int ret;
+
+	if (ctx->batch_posts) {
+		ret = fts_backend_solr_batch_flush(ctx);
+		if (solr_connection_post_wait(backend->solr_conn) < 0)
+			ret = -1;
+		return ret;
+	}
 	if (ctx->post == NULL)
 		return 0;
 
@@ -341,7 +389,20 @@ fts_backend_solr_expunge_flush(struct solr_fts_backend_update_context *ctx)
 		(struct solr_fts_backend *)ctx->ctx.backend;
 
 	str_append(ctx->cmd_expunge, "</delete>");
-	(void)solr_connection_post(backend->solr_conn, str_c(ctx->cmd_expunge));
+	if (!ctx->batch_posts) {
+		(void)solr_connection_post(backend->solr_conn,
+					   str_c(ctx->cmd_expunge));
+	} else {
+		/* the deletes mustn't be processed before the documents
+		   that were added earlier, including the ones that are
+		   still buffered */
+		if (fts_backend_solr_batch_flush(ctx) < 0 ||
+		    solr_connection_post_wait(backend->solr_conn) < 0 ||
+		    solr_connection_post_async(backend->solr_conn,
+					       str_data(ctx->cmd_expunge),
+					       str_len(ctx->cmd_expunge)) < 0)
+			ctx->ctx.failed = TRUE;
+	}
 	str_truncate(ctx->cmd_expunge, 0);
 	str_append(ctx->cmd_expunge, "<delete>");
 }
@@ -363,8 +424,11 @@ fts_backend_solr_update_deinit(struct fts_backend_update_context *_ctx)
 	if (ctx->documents_added || ctx->expunges) {
 		/* commit and wait until the documents we just indexed are
 		   visible to the following search */
-		if (ctx->expunges)
+		if (ctx->expunges) {
 			fts_backend_solr_expunge_flush(ctx);
+			if (_ctx->failed)
+				ret = -1;
+		}
 		str = t_strdup_printf("<commit softCommit=\"true\" waitSearcher=\"%s\"/>",
 				      ctx->documents_added ? "true" : "false");
 		if (solr_connection_post(backend->solr_conn, str) < 0)
@@ -451,7 +515,17 @@ fts_backend_solr_uid_changed(struct solr_fts_backend_update_context *ctx,
 	struct solr_fts_backend *backend =
 		(struct solr_fts_backend *)ctx->ctx.backend;
 
-	if (ctx->post == NULL) {
+	if (ctx->batch_posts) {
+		if (ctx->cmd == NULL) {
+			ctx->cmd = str_new(default_pool, SOLR_CMDBUF_SIZE);
+			str_append(ctx->cmd, "<add>");
+		} else {
+			fts_backend_solr_doc_close(ctx);
+			if (str_len(ctx->cmd) >= SOLR_BATCH_FLUSH_SIZE &&
+			    fts_backend_solr_batch_post(ctx) < 0)
+				ctx->ctx.failed = TRUE;
+		}
+	} else if (ctx->post == NULL) {
 		i_assert(ctx->prev_uid == 0);
 
 		ctx->cmd = str_new(default_pool, SOLR_CMDBUF_SIZE);
@@ -472,7 +546,8 @@ fts_backend_solr_update_set_build_key(struct fts_backend_update_context *_ctx,
 	struct solr_fts_backend_update_context *ctx =
 		(struct solr_fts_backend_update_context *)_ctx;
 
-	if (key->uid != ctx->prev_uid)
+	if (key->uid != ctx->prev_uid ||
+	    (ctx->batch_posts && ctx->cmd == NULL))
 		fts_backend_solr_uid_changed(ctx, key->uid);
 
 	switch (key->type) {
@@ -531,7 +606,7 @@ fts_backend_solr_update_build_more(struct fts_backend_update_context *_ctx,
 	if (ctx->cur_value2 == NULL && ctx->cur_value == ctx->cmd) {
 		/* we're writing to message body. if size is huge,
 		   flush it once in a while */
-		while (size >= SOLR_CMDBUF_FLUSH_SIZE) {
+		while (size >= SOLR_CMDBUF_FLUSH_SIZE && !ctx->batch_posts) {
 			if (str_len(ctx->cmd) >= SOLR_CMDBUF_FLUSH_SIZE) {
 				solr_connection_post_more(ctx->post,
 							  str_data(ctx->cmd),
@@ -556,7 +631,8 @@ fts_backend_solr_update_build_more(struct fts_backend_update_context *_ctx,
 			xml_encode_data(ctx->cur_value2, data, size);
 	}
 
-	if (str_len(ctx->cmd) >= SOLR_CMDBUF_FLUSH_SIZE) {
+	if (str_len(ctx->cmd) >= SOLR_CMDBUF_FLUSH_SIZE && !ctx->batch_posts) {
+		/* documents can't be split across batches */
 		solr_connection_post_more(ctx->post, str_data(ctx->cmd),
 					  str_len(ctx->cmd));
 		str_truncate(ctx->cmd, 0);
@@ -737,9 +813,6 @@ static int solr_search(struct fts_backend *_backend, string_t *str,
 		       ARRAY_TYPE(fts_score_map) *scores_r)
 {
 	struct solr_fts_backend *backend = (struct solr_fts_backend *)_backend;
-	pool_t pool = pool_alloconly_create("fts solr search", 1024);
-	struct solr_result **results;
-	int ret;
 
 	/* use a separate filter query for selecting the mailbox. it shouldn't
 	   affect the score and there could be some caching benefits too. */
@@ -749,14 +822,8 @@ static int solr_search(struct fts_backend *_backend, string_t *str,
 	else
 		str_append(str, "%22%22");
 
-	ret = solr_connection_select(backend->solr_conn, str_c(str),
-				     pool, &results);
-	if (ret == 0 && results[0] != NULL) {
-		array_append_array(uids_r, &results[0]->uids);
-		array_append_array(scores_r, &results[0]->scores);
-	}
-	pool_unref(&pool);
-	return ret;
+	return solr_connection_select_uids(backend->solr_conn, str_c(str),
+					   uids_r, scores_r);
 }
 
 static int
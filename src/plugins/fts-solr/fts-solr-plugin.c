@@ -35,6 +35,12 @@ fts_solr_plugin_init_settings(struct mail_user *user,
 		} else if (strcmp(*tmp, "default_ns=") == 0) {
 			set->default_ns_prefix =
 				p_strdup(user->pool, *tmp + 11);
+		} else if (strncmp(*tmp, "max_pending_posts=", 18) == 0) {
+			if (str_to_uint(*tmp + 18, &set->max_pending_posts) < 0) {
+				i_error("fts_solr: Invalid max_pending_posts: %s",
+					*tmp + 18);
+				return -1;
+			}
 		} else {
 			i_error("fts_solr: Invalid setting: %s", *tmp);
 			return -1;
@@ -10,6 +10,7 @@
 
 struct fts_solr_settings {
 	const char *url, *default_ns_prefix;
+	unsigned int max_pending_posts;
 	bool debug;
 };
 
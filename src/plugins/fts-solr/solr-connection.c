@@ -44,6 +44,12 @@ struct solr_lookup_xml_context {
 	/* box_id -> solr_result */
 	HASH_TABLE(char *, struct solr_result *) mailboxes;
 	ARRAY(struct solr_result *) results;
+	/* the results are sorted by mailbox, so this is usually the one */
+	struct solr_result *last_result;
+
+	/* single mailbox lookup: add the results directly to these */
+	ARRAY_TYPE(seq_range) *uids_dest;
+	ARRAY_TYPE(fts_score_map) *scores_dest;
 };
 
 struct solr_connection_post {
@@ -64,10 +70,15 @@ struct solr_connection {
 
 	int request_status;
 
+	/* asynchronous update posts that haven't finished yet */
+	unsigned int pending_posts, max_pending_posts;
+	int pending_posts_status;
+
 	struct istream *payload;
 	struct io *io;
 
 	unsigned int debug:1;
+	unsigned int waiting_posts:1;
 	unsigned int posting:1;
 	unsigned int xml_failed:1;
 	unsigned int http_ssl:1;
@@ -99,6 +110,7 @@ static int solr_xml_parse(struct solr_connection *conn,
 }
 
 int solr_connection_init(const char *url, bool debug,
+			 unsigned int max_pending_posts,
 			 struct solr_connection **conn_r, const char **error_r)
 {
 	struct http_client_settings http_set;
@@ -119,11 +131,13 @@ int solr_connection_init(const char *url, bool debug,
 	conn->http_base_url = i_strconcat(http_url->path, http_url->enc_query, NULL);
 	conn->http_ssl = http_url->have_ssl;
 	conn->debug = debug;
+	conn->max_pending_posts = I_MAX(max_pending_posts, 1);
 
 	if (solr_http_client == NULL) {
 		memset(&http_set, 0, sizeof(http_set));
 		http_set.max_idle_time_msecs = 5*1000;
-		http_set.max_parallel_connections = 1;
+		/* each pending post is sent over its own connection */
+		http_set.max_parallel_connections = conn->max_pending_posts;
 		http_set.max_pipelined_requests = 1;
 		http_set.max_redirects = 1;
 		http_set.max_attempts = 3;
@@ -142,6 +156,8 @@ int solr_connection_init(const char *url, bool debug,
 
 void solr_connection_deinit(struct solr_connection *conn)
 {
+	i_assert(conn->pending_posts == 0);
+
 	XML_ParserFree(conn->xml_parser);
 	i_free(conn->http_host);
 	i_free(conn->http_base_url);
@@ -218,9 +234,15 @@ solr_result_get(struct solr_lookup_xml_context *ctx, const char *box_id)
 	struct solr_result *result;
 	char *box_id_dup;
 
+	if (ctx->last_result != NULL &&
+	    strcmp(ctx->last_result->box_id, box_id) == 0)
+		return ctx->last_result;
+
 	result = hash_table_lookup(ctx->mailboxes, box_id);
-	if (result != NULL)
+	if (result != NULL) {
+		ctx->last_result = result;
 		return result;
+	}
 
 	box_id_dup = p_strdup(ctx->result_pool, box_id);
 	result = p_new(ctx->result_pool, struct solr_result, 1);
@@ -229,12 +251,28 @@ solr_result_get(struct solr_lookup_xml_context *ctx, const char *box_id)
 	p_array_init(&result->scores, ctx->result_pool, 32);
 	hash_table_insert(ctx->mailboxes, box_id_dup, result);
 	array_append(&ctx->results, &result, 1);
+	ctx->last_result = result;
 	return result;
 }
 
-static void solr_lookup_add_doc(struct solr_lookup_xml_context *ctx)
+static void
+solr_lookup_add_uid(struct solr_lookup_xml_context *ctx,
+		    ARRAY_TYPE(seq_range) *uids,
+		    ARRAY_TYPE(fts_score_map) *scores)
 {
 	struct fts_score_map *score;
+
+	if (seq_range_array_add(uids, ctx->uid)) {
+		/* duplicate result */
+	} else if (ctx->score != 0) {
+		score = array_append_space(scores);
+		score->uid = ctx->uid;
+		score->score = ctx->score;
+	}
+}
+
+static void solr_lookup_add_doc(struct solr_lookup_xml_context *ctx)
+{
 	struct solr_result *result;
 	const char *box_id;
 
@@ -242,6 +280,10 @@ static void solr_lookup_add_doc(struct solr_lookup_xml_context *ctx)
 		i_error("fts_solr: Query didn't return uid");
 		return;
 	}
+	if (ctx->uids_dest != NULL) {
+		solr_lookup_add_uid(ctx, ctx->uids_dest, ctx->scores_dest);
+		return;
+	}
 
 	if (ctx->mailbox == NULL) {
 		/* looking up from a single mailbox only */
@@ -259,14 +301,7 @@ static void solr_lookup_add_doc(struct solr_lookup_xml_context *ctx)
 		box_id = ctx->mailbox;
 	}
 	result = solr_result_get(ctx, box_id);
-
-	if (seq_range_array_add(&result->uids, ctx->uid)) {
-		/* duplicate result */
-	} else if (ctx->score != 0) {
-		score = array_append_space(&result->scores);
-		score->uid = ctx->uid;
-		score->score = ctx->score;
-	}
+	solr_lookup_add_uid(ctx, &result->uids, &result->scores);
 }
 
 static void solr_lookup_xml_end(void *context, const char *name ATTR_UNUSED)
@@ -396,29 +431,23 @@ solr_connection_select_response(const struct http_response *response,
 	solr_connection_payload_input(conn);
 }
 
-int solr_connection_select(struct solr_connection *conn, const char *query,
-			   pool_t pool, struct solr_result ***box_results_r)
+static int
+solr_connection_select_real(struct solr_connection *conn, const char *query,
+			    struct solr_lookup_xml_context *lookup_ctx)
 {
-	struct solr_lookup_xml_context solr_lookup_context;
 	struct http_client_request *http_req;
 	const char *url;
-	int parse_ret;
+	int ret;
 
 	i_assert(!conn->posting);
 
-	memset(&solr_lookup_context, 0, sizeof(solr_lookup_context));
-	solr_lookup_context.result_pool = pool;
-	hash_table_create(&solr_lookup_context.mailboxes, default_pool, 0,
-			  str_hash, strcmp);
-	p_array_init(&solr_lookup_context.results, pool, 32);
-
 	i_free_and_null(conn->http_failure);
 	conn->xml_failed = FALSE;
 	XML_ParserReset(conn->xml_parser, "UTF-8");
 	XML_SetElementHandler(conn->xml_parser,
 			      solr_lookup_xml_start, solr_lookup_xml_end);
 	XML_SetCharacterDataHandler(conn->xml_parser, solr_lookup_xml_data);
-	XML_SetUserData(conn->xml_parser, &solr_lookup_context);
+	XML_SetUserData(conn->xml_parser, lookup_ctx);
 
 	url = t_strconcat(conn->http_base_url, "select?", query, NULL);
 
@@ -430,18 +459,52 @@ int solr_connection_select(struct solr_connection *conn, const char *query,
 	http_client_request_add_header(http_req, "Content-Type", "text/xml");
 	http_client_request_submit(http_req);
 
+	/* the response is parsed as it arrives */
 	conn->request_status = 0;
 	http_client_wait(solr_http_client);
 
 	if (conn->request_status < 0)
-		return -1;
+		ret = -1;
+	else
+		ret = solr_xml_parse(conn, "", 0, TRUE);
+	i_free(lookup_ctx->mailbox);
+	i_free(lookup_ctx->ns);
+	return ret;
+}
+
+int solr_connection_select(struct solr_connection *conn, const char *query,
+			   pool_t pool, struct solr_result ***box_results_r)
+{
+	struct solr_lookup_xml_context solr_lookup_context;
+	int ret;
 
-	parse_ret = solr_xml_parse(conn, "", 0, TRUE);
+	memset(&solr_lookup_context, 0, sizeof(solr_lookup_context));
+	solr_lookup_context.result_pool = pool;
+	hash_table_create(&solr_lookup_context.mailboxes, default_pool, 0,
+			  str_hash, strcmp);
+	p_array_init(&solr_lookup_context.results, pool, 32);
+
+	ret = solr_connection_select_real(conn, query, &solr_lookup_context);
 	hash_table_destroy(&solr_lookup_context.mailboxes);
+	if (ret < 0)
+		return -1;
 
 	array_append_zero(&solr_lookup_context.results);
 	*box_results_r = array_idx_modifiable(&solr_lookup_context.results, 0);
-	return parse_ret;
+	return 0;
+}
+
+int solr_connection_select_uids(struct solr_connection *conn,
+				const char *query,
+				ARRAY_TYPE(seq_range) *uids,
+				ARRAY_TYPE(fts_score_map) *scores)
+{
+	struct solr_lookup_xml_context solr_lookup_context;
+
+	memset(&solr_lookup_context, 0, sizeof(solr_lookup_context));
+	solr_lookup_context.uids_dest = uids;
+	solr_lookup_context.scores_dest = scores;
+	return solr_connection_select_real(conn, query, &solr_lookup_context);
 }
 
 static void
@@ -522,13 +585,107 @@ int solr_connection_post_end(struct solr_connection_post *post)
 	return ret;
 }
 
+static void solr_connection_post_payload_free(unsigned char *data)
+{
+	i_free(data);
+}
+
+static void
+solr_connection_async_post_response(const struct http_response *response,
+				    struct solr_connection *conn)
+{
+	i_assert(conn->pending_posts > 0);
+	conn->pending_posts--;
+
+	if (response->status / 100 != 2) {
+		i_error("fts_solr: Indexing failed: %s", response->reason);
+		conn->pending_posts_status = -1;
+	}
+	if (conn->waiting_posts)
+		io_loop_stop(current_ioloop);
+}
+
+static void
+solr_connection_wait_posts(struct solr_connection *conn,
+			   unsigned int max_pending)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+	struct ioloop *ioloop;
+
+	if (conn->pending_posts <= max_pending)
+		return;
+
+	ioloop = io_loop_create();
+	http_client_switch_ioloop(solr_http_client);
+	conn->waiting_posts = TRUE;
+	while (conn->pending_posts > max_pending)
+		io_loop_run(ioloop);
+	conn->waiting_posts = FALSE;
+
+	io_loop_set_current(prev_ioloop);
+	http_client_switch_ioloop(solr_http_client);
+	io_loop_set_current(ioloop);
+	io_loop_destroy(&ioloop);
+}
+
+int solr_connection_post_async(struct solr_connection *conn,
+			       const unsigned char *data, size_t size)
+{
+	struct http_client_request *http_req;
+	struct istream *post_payload;
+	unsigned char *data_copy;
+
+	i_assert(!conn->posting);
+
+	/* make room for this post */
+	solr_connection_wait_posts(conn, conn->max_pending_posts - 1);
+	if (conn->pending_posts_status < 0)
+		return -1;
+
+	data_copy = i_malloc(size);
+	memcpy(data_copy, data, size);
+	post_payload = i_stream_create_from_data(data_copy, size);
+	i_stream_add_destroy_callback(post_payload,
+				      solr_connection_post_payload_free,
+				      data_copy);
+
+	http_req = http_client_request(solr_http_client, "POST",
+				       conn->http_host,
+				       t_strconcat(conn->http_base_url,
+						   "update", NULL),
+				       solr_connection_async_post_response,
+				       conn);
+	http_client_request_set_port(http_req, conn->http_port);
+	http_client_request_set_ssl(http_req, conn->http_ssl);
+	http_client_request_add_header(http_req, "Content-Type", "text/xml");
+	http_client_request_set_payload(http_req, post_payload, FALSE);
+	i_stream_unref(&post_payload);
+	http_client_request_submit(http_req);
+	conn->pending_posts++;
+	return 0;
+}
+
+int solr_connection_post_wait(struct solr_connection *conn)
+{
+	int ret;
+
+	solr_connection_wait_posts(conn, 0);
+	ret = conn->pending_posts_status;
+	conn->pending_posts_status = 0;
+	return ret;
+}
+
 int solr_connection_post(struct solr_connection *conn, const char *cmd)
 {
 	struct http_client_request *http_req;
 	struct istream *post_payload;
+	int ret;
 
 	i_assert(!conn->posting);
 
+	/* the earlier updates must be finished before e.g. a commit */
+	ret = solr_connection_post_wait(conn);
+
 	http_req = solr_connection_post_request(conn);
 	post_payload = i_stream_create_from_data(cmd, strlen(cmd));
 	http_client_request_set_payload(http_req, post_payload, TRUE);
@@ -540,5 +697,5 @@ int solr_connection_post(struct solr_connection *conn, const char *cmd)
 	conn->request_status = 0;
 	http_client_wait(solr_http_client);
 
-	return conn->request_status;
+	return ret < 0 ? -1 : conn->request_status;
 }
@@ -14,12 +14,30 @@ struct solr_result {
 };
 
 int solr_connection_init(const char *url, bool debug,
+			 unsigned int max_pending_posts,
 			 struct solr_connection **conn_r, const char **error_r);
 void solr_connection_deinit(struct solr_connection *conn);
 
 int solr_connection_select(struct solr_connection *conn, const char *query,
 			   pool_t pool, struct solr_result ***box_results_r);
+/* Like solr_connection_select(), but for a query that returns documents from
+   a single mailbox only. The UIDs and scores are added directly to the given
+   arrays while the response is being read. */
+int solr_connection_select_uids(struct solr_connection *conn,
+				const char *query,
+				ARRAY_TYPE(seq_range) *uids,
+				ARRAY_TYPE(fts_score_map) *scores);
+/* Post the command and wait for it and any pending asynchronous posts to
+   finish. */
 int solr_connection_post(struct solr_connection *conn, const char *cmd);
+/* Post an update without waiting for its response. Up to max_pending_posts
+   posts are sent in parallel, after that this first waits for one of them
+   to finish. Returns -1 if any of the earlier posts had failed. */
+int solr_connection_post_async(struct solr_connection *conn,
+			       const unsigned char *data, size_t size);
+/* Wait for all the asynchronous posts to finish. Returns 0 if they were all
+   successful, -1 if not. */
+int solr_connection_post_wait(struct solr_connection *conn);
 
 struct solr_connection_post *
 solr_connection_post_begin(struct solr_connection *conn);
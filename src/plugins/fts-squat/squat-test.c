@@ -10,6 +10,7 @@
 #include "squat-uidlist.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
@@ -44,6 +45,7 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	buffer_t *valid;
 	int ret, fd;
 	unsigned int len, last = 0, seq = 1, node_count, uidlist_count;
+	unsigned int i, repeat_count = 1;
 	enum squat_index_type index_type;
 	bool data_header = TRUE, first = TRUE, skip_body = FALSE;
 	bool mime_header = TRUE;
@@ -64,6 +66,12 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	fd = open(argv[1], O_RDONLY);
 	if (fd == -1)
 		return 1;
+	if (argv[2] != NULL) {
+		/* benchmark: run each lookup this many times */
+		repeat_count = atoi(argv[2]);
+		if (repeat_count == 0)
+			repeat_count = 1;
+	}
 
 	if (squat_trie_build_init(trie, &build_ctx) < 0)
 		return 1;
@@ -177,15 +185,19 @@ int main(int argc ATTR_UNUSED, char *argv[])
 		str[ret] = 0;
 
 		gettimeofday(&tv_start, NULL);
-		ret = squat_trie_lookup(trie, str, SQUAT_INDEX_TYPE_HEADER |
-					SQUAT_INDEX_TYPE_BODY,
-					&definite_uids, &maybe_uids);
+		for (i = 0, ret = 0; i < repeat_count && ret == 0; i++) {
+			ret = squat_trie_lookup(trie, str,
+						SQUAT_INDEX_TYPE_HEADER |
+						SQUAT_INDEX_TYPE_BODY,
+						&definite_uids, &maybe_uids);
+		}
 		if (ret < 0)
 			printf("error\n");
 		else {
 			gettimeofday(&tv_end, NULL);
 			printf(" - Search took %.05f CPU seconds\n",
-			       timeval_diff_usecs(&tv_end, &tv_start)/1000000.0);
+			       timeval_diff_usecs(&tv_end, &tv_start) /
+			       1000000.0 / repeat_count);
 			printf(" - definite uids: ");
 			result_print(&definite_uids);
 			printf(" - maybe uids: ");
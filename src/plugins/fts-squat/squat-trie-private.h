@@ -4,7 +4,7 @@
 #include "file-dotlock.h"
 #include "squat-trie.h"
 
-#define SQUAT_TRIE_VERSION 2
+#define SQUAT_TRIE_VERSION 3
 #define SQUAT_TRIE_LOCK_TIMEOUT 60
 #define SQUAT_TRIE_DOTLOCK_STALE_TIMEOUT (15*60)
 
@@ -29,23 +29,49 @@ struct squat_file_header {
 };
 
 /*
-   node file: FIXME: no up-to-date
+   node file:
 
    struct squat_file_header;
 
-   // children are written before their parents
+   // children are written before their parents. each node is written as
+   // a 32bit aligned block, so a lookup can use its chars and children
+   // directly from the mmaped file. the chars and children don't cross a
+   // SQUAT_TRIE_CACHE_LINE_SIZE boundary if they fit into one cache line,
+   // otherwise they start at one.
    node[] {
+     (padding)
      uint8_t child_count;
      unsigned char chars[child_count];
-     packed neg_diff_to_first_child_offset; // relative to node
-     packed diff_to_prev_offset[child_count-1];
+     (padding to 32bit)
+     struct squat_file_child children[child_count];
+     // needed only when reading the node to memory, or for a leaf
+     // string at the end of a lookup
      packed[child_count] {
-       // unused_uids_count == uid if have_uid_offset bit is zero
-       (unused_uids_count << 1) | (have_uid_offset);
-       [diff_to_prev_uid_offset;] // first one is relative to zero
+       [next_uid - 1;] // if uid_list_idx isn't a singleton
+       (unused_uids << 1) | (have_leaf_string);
+       [leaf_string_length - 1; unsigned char leaf_string[];]
      }
    }
+   uint8_t guard; // for detecting truncated packed numbers
+
+   All offsets are 32bit, so the file can't grow over 4 GB.
 */
+#define SQUAT_TRIE_NODE_ALIGN 4
+#define SQUAT_TRIE_CACHE_LINE_SIZE 64
+
+struct squat_file_child {
+	/* absolute offset to this child's node block, 0 = no children */
+	uint32_t children_offset;
+	uint32_t uid_list_idx;
+};
+/* Offset to children[] from the beginning of the node block */
+#define SQUAT_FILE_NODE_CHILDREN_OFFSET(child_count) \
+	(((child_count) + 1 + 3) & ~3U)
+/* Size of the node block */
+#define SQUAT_FILE_NODE_SIZE(child_count) \
+	(SQUAT_FILE_NODE_CHILDREN_OFFSET(child_count) + \
+	 (child_count) * sizeof(struct squat_file_child))
+#define SQUAT_FILE_NODE_MAX_SIZE SQUAT_FILE_NODE_SIZE(255)
 
 struct squat_node {
 	unsigned int child_count:8;
@@ -139,6 +165,10 @@ struct squat_trie {
 	unsigned int default_full_len;
 
 	unsigned int corrupted:1;
+	/* mmap_base contains the current file and the in-memory nodes have
+	   no unwritten changes, so lookups can use the mapped nodes
+	   directly. */
+	unsigned int mmap_nodes_current:1;
 };
 
 #define SQUAT_PACK_MAX_SIZE ((sizeof(uint32_t) * 8 + 7) / 7)
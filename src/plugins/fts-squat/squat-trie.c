@@ -26,10 +26,9 @@
 #define MAX_FAST_LEVEL 3
 #define SEQUENTIAL_COUNT 46
 
+/* next_uid, unused_uids and leaf string length */
 #define TRIE_BYTES_LEFT(n) \
-	((n) * SQUAT_PACK_MAX_SIZE)
-#define TRIE_READAHEAD_SIZE \
-	I_MAX(4096, 1 + 256 + TRIE_BYTES_LEFT(256))
+	((n) * SQUAT_PACK_MAX_SIZE * 3)
 
 struct squat_trie_build_context {
 	struct squat_trie *trie;
@@ -156,6 +155,7 @@ squat_trie_init(const char *path, uint32_t uidvalidity,
 
 static void squat_trie_close_fd(struct squat_trie *trie)
 {
+	trie->mmap_nodes_current = FALSE;
 	trie->data = NULL;
 	trie->data_size = 0;
 
@@ -430,15 +430,86 @@ trie_file_cache_read(struct squat_trie *trie, size_t offset, size_t size)
 	return 0;
 }
 
+static int
+trie_map_node(struct squat_trie *trie, uoff_t offset,
+	      const unsigned char **chars_r,
+	      const struct squat_file_child **children_r,
+	      unsigned int *child_count_r)
+{
+	const uint8_t *data;
+	unsigned int child_count;
+
+	if (unlikely(offset % SQUAT_TRIE_NODE_ALIGN != 0 ||
+		     offset >= trie->locked_file_size)) {
+		squat_trie_set_corrupted(trie);
+		return -1;
+	}
+	if (trie_file_cache_read(trie, offset, SQUAT_FILE_NODE_MAX_SIZE) < 0)
+		return -1;
+	if (unlikely(offset >= trie->data_size)) {
+		squat_trie_set_corrupted(trie);
+		return -1;
+	}
+
+	data = CONST_PTR_OFFSET(trie->data, offset);
+	child_count = data[0];
+	if (unlikely(offset + SQUAT_FILE_NODE_SIZE(child_count) >
+		     trie->data_size)) {
+		squat_trie_set_corrupted(trie);
+		return -1;
+	}
+	*chars_r = data + 1;
+	*children_r = CONST_PTR_OFFSET(data,
+			SQUAT_FILE_NODE_CHILDREN_OFFSET(child_count));
+	*child_count_r = child_count;
+	return 0;
+}
+
+static int
+trie_map_leaf_string(struct squat_trie *trie, uoff_t node_offset,
+		     const struct squat_file_child *file_children,
+		     unsigned int child_count, unsigned int child_idx,
+		     const unsigned char **str_r, unsigned int *len_r)
+{
+	const uint8_t *data, *end;
+	unsigned int i, len;
+	uint32_t num;
+
+	/* the whole file is mapped, so there's no need to read anything */
+	i_assert(trie->file_cache == NULL);
+
+	data = CONST_PTR_OFFSET(trie->data, node_offset +
+				SQUAT_FILE_NODE_SIZE(child_count));
+	end = CONST_PTR_OFFSET(trie->data, trie->data_size);
+	for (i = 0;; i++) {
+		if (!UIDLIST_IS_SINGLETON(file_children[i].uid_list_idx))
+			(void)squat_unpack_num(&data, end);
+		num = squat_unpack_num(&data, end);
+		len = (num & 1) == 0 ? 0 : squat_unpack_num(&data, end) + 1;
+		if (unlikely((size_t)(end - data) <= len)) {
+			squat_trie_set_corrupted(trie);
+			return -1;
+		}
+		if (i == child_idx)
+			break;
+		data += len;
+	}
+	*str_r = data;
+	*len_r = len;
+	return 0;
+}
+
 static int
 node_read_children(struct squat_trie *trie, struct squat_node *node, int level)
 {
+	const struct squat_file_child *mapped_children;
+	struct squat_file_child file_children[256];
+	const unsigned char *mapped_chars;
+	unsigned char child_chars[256];
 	const uint8_t *data, *end;
-	const unsigned char *child_chars;
 	struct squat_node *child, *children = NULL;
-	uoff_t node_offset;
+	uoff_t node_offset, offset;
 	unsigned int i, child_idx, child_count;
-	uoff_t base_offset;
 	uint32_t num;
 
 	i_assert(node->children_not_mapped);
@@ -451,29 +522,25 @@ node_read_children(struct squat_trie *trie, struct squat_node *node, int level)
 	node->children_not_mapped = FALSE;
 	node->children.data = NULL;
 
-	if (trie_file_cache_read(trie, node_offset, TRIE_READAHEAD_SIZE) < 0)
+	if (trie_map_node(trie, node_offset, &mapped_chars, &mapped_children,
+			  &child_count) < 0)
 		return -1;
-	if (unlikely(node_offset >= trie->data_size)) {
-		squat_trie_set_corrupted(trie);
+	/* reading the packed data may move the file cache's mapping */
+	memcpy(child_chars, mapped_chars, child_count);
+	memcpy(file_children, mapped_children,
+	       sizeof(file_children[0]) * child_count);
+
+	offset = node_offset + SQUAT_FILE_NODE_SIZE(child_count);
+	if (trie_file_cache_read(trie, offset,
+				 TRIE_BYTES_LEFT(child_count)) < 0)
 		return -1;
-	}
-
-	data = CONST_PTR_OFFSET(trie->data, node_offset);
-	end = CONST_PTR_OFFSET(trie->data, trie->data_size);
-	child_count = *data++;
-	if (unlikely(node_offset + child_count >= trie->data_size)) {
+	if (unlikely(offset >= trie->data_size)) {
 		squat_trie_set_corrupted(trie);
 		return -1;
 	}
+	data = CONST_PTR_OFFSET(trie->data, offset);
+	end = CONST_PTR_OFFSET(trie->data, trie->data_size);
 
-	if (child_count == 0)
-		return 0;
-
-	child_chars = data;
-	data += child_count;
-
-	/* get child offsets */
-	base_offset = node_offset;
 	for (i = 0; i < child_count; i++) {
 		/* we always start with !have_sequential, so at i=0 this
 		   check always goes to add the first child */
@@ -486,34 +553,15 @@ node_read_children(struct squat_trie *trie, struct squat_node *node, int level)
 		}
 		child = &children[child_idx];
 
-		/* 1) child offset */
-		num = squat_unpack_num(&data, end);
-		if (num == 0) {
-			/* no children */
-		} else {
-			if ((num & 1) != 0) {
-				base_offset += num >> 1;
-			} else {
-				base_offset -= num >> 1;
-			}
-			if (base_offset >= trie->locked_file_size) {
-				squat_trie_set_corrupted(trie);
-				return -1;
-			}
-			trie->unmapped_child_count++;
-			child->children_not_mapped = TRUE;
-			child->children.offset = base_offset;
-		}
-
-		/* 2) uidlist */
-		child->uid_list_idx = squat_unpack_num(&data, end);
+		/* 1) uidlist */
+		child->uid_list_idx = file_children[i].uid_list_idx;
 		if (child->uid_list_idx == 0) {
 			/* we don't write nodes with empty uidlists */
 			squat_trie_set_corrupted(trie);
 			return -1;
 		}
 		if (!UIDLIST_IS_SINGLETON(child->uid_list_idx)) {
-			/* 3) next uid */
+			/* 2) next uid */
 			child->next_uid = squat_unpack_num(&data, end) + 1;
 		} else {
 			uint32_t idx = child->uid_list_idx;
@@ -522,15 +570,28 @@ node_read_children(struct squat_trie *trie, struct squat_node *node, int level)
 				squat_uidlist_singleton_last_uid(idx);
 		}
 
-		/* 4) unused uids + leaf string flag */
+		/* 3) unused uids + leaf string flag */
 		num = squat_unpack_num(&data, end);
 		child->unused_uids = num >> 1;
-		if ((num & 1) != 0) {
+		if ((num & 1) == 0) {
+			/* 4a) children */
+			if (file_children[i].children_offset != 0) {
+				trie->unmapped_child_count++;
+				child->children_not_mapped = TRUE;
+				child->children.offset =
+					file_children[i].children_offset;
+			}
+		} else {
 			/* leaf string */
 			unsigned int len;
 			unsigned char *dest;
 
-			/* 5) leaf string length */
+			if (unlikely(file_children[i].children_offset != 0)) {
+				squat_trie_set_corrupted(trie);
+				return -1;
+			}
+
+			/* 4b) leaf string length */
 			len = child->leaf_string_length =
 				squat_unpack_num(&data, end) + 1;
 			if (!NODE_IS_DYNAMIC_LEAF(child))
@@ -543,7 +604,7 @@ node_read_children(struct squat_trie *trie, struct squat_node *node, int level)
 			if (trie->file_cache != NULL) {
 				/* the string may be long -
 				   recalculate the end pos */
-				size_t offset, size;
+				size_t size;
 
 				offset = (const char *)data -
 					(const char *)trie->data;
@@ -555,8 +616,6 @@ node_read_children(struct squat_trie *trie, struct squat_node *node, int level)
 				data = CONST_PTR_OFFSET(trie->data, offset);
 				end = CONST_PTR_OFFSET(trie->data,
 						       trie->data_size);
-				child_chars = CONST_PTR_OFFSET(trie->data,
-							       node_offset + 1);
 			}
 
 			if ((size_t)(end - data) < len) {
@@ -575,55 +634,70 @@ node_read_children(struct squat_trie *trie, struct squat_node *node, int level)
 	return 0;
 }
 
-static void
+static unsigned int squat_file_node_padding(uoff_t offset, unsigned int size)
+{
+	unsigned int pad, line_left;
+
+	pad = (SQUAT_TRIE_NODE_ALIGN - offset % SQUAT_TRIE_NODE_ALIGN) %
+		SQUAT_TRIE_NODE_ALIGN;
+	line_left = SQUAT_TRIE_CACHE_LINE_SIZE -
+		(offset + pad) % SQUAT_TRIE_CACHE_LINE_SIZE;
+	if (size > line_left && line_left != SQUAT_TRIE_CACHE_LINE_SIZE) {
+		/* don't let the block cross a cache line unnecessarily */
+		pad += line_left;
+	}
+	return pad;
+}
+
+static uoff_t
 node_write_children(struct squat_trie_build_context *ctx,
 		    struct squat_node *node, const uoff_t *node_offsets)
 {
+	static const unsigned char zeros[SQUAT_TRIE_CACHE_LINE_SIZE] = { 0, };
 	struct squat_node *children;
+	struct squat_file_child *file_children;
 	const unsigned char *chars;
-	uint8_t child_count, buf[SQUAT_PACK_MAX_SIZE * 5], *bufp;
-	uoff_t base_offset;
-	unsigned int i;
+	uint8_t buf[SQUAT_PACK_MAX_SIZE * 3], *bufp;
+	unsigned char *block;
+	unsigned int i, child_count, size;
+	uoff_t node_offset;
 
 	chars = NODE_CHILDREN_CHARS(node);
 	children = NODE_CHILDREN_NODES(node);
-
-	base_offset = ctx->output->offset;
 	child_count = node->child_count;
-	o_stream_nsend(ctx->output, &child_count, 1);
-	o_stream_nsend(ctx->output, chars, child_count);
 
+	size = SQUAT_FILE_NODE_SIZE(child_count);
+	block = t_malloc0(size);
+	block[0] = child_count;
+	memcpy(block + 1, chars, child_count);
+	file_children = PTR_OFFSET(block,
+			SQUAT_FILE_NODE_CHILDREN_OFFSET(child_count));
 	for (i = 0; i < child_count; i++) {
-		bufp = buf;
-		/* 1) child offset */
-		if (node_offsets[i] == 0)
-			*bufp++ = 0;
-		else if (node_offsets[i] >= base_offset) {
-			squat_pack_num(&bufp,
-				((node_offsets[i] - base_offset) << 1) | 1);
-			base_offset = node_offsets[i];
-		} else {
-			squat_pack_num(&bufp,
-				       (base_offset - node_offsets[i]) << 1);
-			base_offset = node_offsets[i];
-		}
+		file_children[i].children_offset = node_offsets[i];
+		file_children[i].uid_list_idx = children[i].uid_list_idx;
+	}
 
-		/* 2) uidlist */
-		squat_pack_num(&bufp, children[i].uid_list_idx);
+	o_stream_nsend(ctx->output, zeros,
+		       squat_file_node_padding(ctx->output->offset, size));
+	node_offset = ctx->output->offset;
+	o_stream_nsend(ctx->output, block, size);
+
+	for (i = 0; i < child_count; i++) {
+		bufp = buf;
 		if (!UIDLIST_IS_SINGLETON(children[i].uid_list_idx)) {
-			/* 3) next uid */
+			/* 2) next uid */
 			squat_pack_num(&bufp, children[i].next_uid - 1);
 		}
 
 		if (children[i].leaf_string_length == 0) {
-			/* 4a) unused uids */
+			/* 3a) unused uids */
 			squat_pack_num(&bufp, children[i].unused_uids << 1);
 			o_stream_nsend(ctx->output, buf, bufp - buf);
 		} else {
 			i_assert(node_offsets[i] == 0);
-			/* 4b) unused uids + flag */
+			/* 3b) unused uids + flag */
 			squat_pack_num(&bufp, (children[i].unused_uids << 1) | 1);
-			/* 5) leaf string length */
+			/* 4b) leaf string length */
 			squat_pack_num(&bufp, children[i].leaf_string_length - 1);
 			o_stream_nsend(ctx->output, buf, bufp - buf);
 			o_stream_nsend(ctx->output,
@@ -631,6 +705,7 @@ node_write_children(struct squat_trie_build_context *ctx,
 				       children[i].leaf_string_length);
 		}
 	}
+	return node_offset;
 }
 
 static inline void
@@ -1043,8 +1118,7 @@ squat_write_node(struct squat_trie_build_context *ctx, struct squat_node *node,
 			return -1;
 	}
 
-	*node_offset_r = ctx->output->offset;
-	node_write_children(ctx, node, node_offsets);
+	*node_offset_r = node_write_children(ctx, node, node_offsets);
 	return 0;
 }
 
@@ -1486,6 +1560,7 @@ static int squat_trie_map(struct squat_trie *trie, bool building)
 	bool changed;
 	int ret;
 
+	trie->mmap_nodes_current = FALSE;
 	if (trie->fd != -1) {
 		if (squat_trie_lock(trie, F_RDLCK, &file_lock, &dotlock) <= 0)
 			return -1;
@@ -1527,6 +1602,9 @@ static int squat_trie_map(struct squat_trie *trie, bool building)
 	if (ret >= 0 && !building) {
 		/* do this while we're still locked */
 		ret = squat_uidlist_refresh(trie->uidlist);
+		/* building modifies the in-memory nodes, which are written
+		   to a new file */
+		trie->mmap_nodes_current = ret == 0 && trie->mmap_base != NULL;
 	}
 
 	if (file_lock != NULL)
@@ -1672,6 +1750,12 @@ static int squat_trie_write(struct squat_trie_build_context *ctx)
 	   squat_unpack_num() input by checking if data==end */
 	o_stream_nsend(output, "", 1);
 
+	if (output->offset > (uint32_t)-1) {
+		/* the file's 32bit offsets have been truncated */
+		i_error("squat trie %s: File would grow over 4 GB", path);
+		ret = -1;
+	}
+
 	if (trie->corrupted)
 		ret = -1;
 	if (ret == 0)
@@ -1771,6 +1855,69 @@ int squat_trie_get_last_uid(struct squat_trie *trie, uint32_t *last_uid_r)
 	return 0;
 }
 
+static int
+squat_trie_lookup_mapped(struct squat_trie *trie, const unsigned char *data,
+			 unsigned int size, ARRAY_TYPE(seq_range) *uids)
+{
+	const struct squat_file_child *file_children, *child;
+	const unsigned char *chars, *p, *str;
+	unsigned int child_count, child_idx, leaf_len;
+	uint32_t node_offset = trie->hdr.root_offset;
+	uint32_t uid_list_idx = trie->hdr.root_uidlist_idx;
+	bool root = TRUE;
+
+	/* same as squat_trie_lookup_data(), but without reading the nodes
+	   to memory */
+	array_clear(uids);
+	while (size > 0) {
+		if (node_offset == 0)
+			return 0;
+		if (trie_map_node(trie, node_offset, &chars, &file_children,
+				  &child_count) < 0)
+			return -1;
+		p = memchr(chars, *data, child_count);
+		if (p == NULL)
+			return 0;
+		child_idx = p - chars;
+		child = &file_children[child_idx];
+
+		if (root) {
+			/* root level, add all UIDs */
+			if (squat_uidlist_get_seqrange(trie->uidlist,
+						       uid_list_idx, uids) < 0)
+				return -1;
+			root = FALSE;
+		} else {
+			if (squat_uidlist_filter(trie->uidlist,
+						 uid_list_idx, uids) < 0)
+				return -1;
+		}
+		data++;
+		size--;
+		uid_list_idx = child->uid_list_idx;
+
+		if (child->children_offset == 0 && size > 0) {
+			/* the rest must match the leaf string */
+			if (trie_map_leaf_string(trie, node_offset,
+						 file_children, child_count,
+						 child_idx, &str,
+						 &leaf_len) < 0)
+				return -1;
+			if (size > leaf_len)
+				return 0;
+			if (memcmp(data, str, size) != 0)
+				return 0;
+			/* match */
+			break;
+		}
+		node_offset = child->children_offset;
+	}
+
+	if (squat_uidlist_filter(trie->uidlist, uid_list_idx, uids) < 0)
+		return -1;
+	return 1;
+}
+
 static int
 squat_trie_lookup_data(struct squat_trie *trie, const unsigned char *data,
 		       unsigned int size, ARRAY_TYPE(seq_range) *uids)
@@ -1780,6 +1927,9 @@ squat_trie_lookup_data(struct squat_trie *trie, const unsigned char *data,
 	unsigned int idx;
 	int level = 0;
 
+	if (trie->mmap_nodes_current && size > 0)
+		return squat_trie_lookup_mapped(trie, data, size, uids);
+
 	array_clear(uids);
 
 	for (;;) {
@@ -1358,6 +1358,17 @@ squat_uidlist_get_at_offset(struct squat_uidlist *uidlist, uoff_t offset,
 
 		uidlist_array_append(uids, base_uid++);
 		for (i = 0; i < size; i++) {
+			/* handle the common empty and full bytes at once */
+			if (p[i] == 0) {
+				base_uid += 8;
+				continue;
+			}
+			if (p[i] == 0xff) {
+				uidlist_array_append_range(uids, base_uid,
+							   base_uid + 7);
+				base_uid += 8;
+				continue;
+			}
 			for (j = 0; j < 8; j++, base_uid++) {
 				if ((p[i] & (1 << j)) != 0)
 					uidlist_array_append(uids, base_uid);
@@ -1536,28 +1547,31 @@ int squat_uidlist_filter(struct squat_uidlist *uidlist, uint32_t uid_list_idx,
 	ARRAY_TYPE(seq_range) dest_uids;
 	ARRAY_TYPE(uint32_t) relative_uids;
 	const uint32_t *rel_range;
-	unsigned int i, rel_count, parent_idx, parent_count, diff, parent_uid;
-	uint32_t prev_seq, seq1, seq2;
+	unsigned int i, rel_count, parent_idx, parent_count;
+	uint32_t prev_seq, seq1, seq2, parent_seq, parent_len, last_seq;
+	uint32_t uid1;
 	int ret = 0;
 
 	parent_range = array_get(uids, &parent_count);
 	if (parent_count == 0)
 		return 0;
+	if (unlikely(parent_range[parent_count-1].seq2 == (uint32_t)-1)) {
+		i_error("broken UID ranges");
+		return -1;
+	}
 
 	i_array_init(&relative_uids, 128);
 	i_array_init(&dest_uids, 128);
 	if (squat_uidlist_get(uidlist, uid_list_idx, &relative_uids) < 0)
 		ret = -1;
 
-	parent_idx = 0;
+	/* the relative UIDs are indexes to the parent's UIDs. walk through
+	   them a range at a time: parent_seq is the index of
+	   parent_range[parent_idx].seq1. */
+	parent_idx = 0; parent_seq = 0;
 	rel_range = array_get(&relative_uids, &rel_count);
-	prev_seq = 0; parent_uid = parent_range[0].seq1;
-	for (i = 0; i < rel_count; i++) {
-		if (unlikely(parent_uid == (uint32_t)-1)) {
-			i_error("broken UID ranges");
-			ret = -1;
-			break;
-		}
+	prev_seq = 0;
+	for (i = 0; i < rel_count && parent_idx < parent_count; i++) {
 		if ((rel_range[i] & UID_LIST_MASK_RANGE) == 0)
 			seq1 = seq2 = rel_range[i];
 		else {
@@ -1565,46 +1579,25 @@ int squat_uidlist_filter(struct squat_uidlist *uidlist, uint32_t uid_list_idx,
 			seq2 = rel_range[++i];
 		}
 		i_assert(seq1 >= prev_seq);
-		diff = seq1 - prev_seq;
-		while (diff > 0) {
-			if (unlikely(parent_uid == (uint32_t)-1)) {
-				i_error("broken UID ranges");
-				ret = -1;
-				break;
-			}
+		prev_seq = seq2 + 1;
 
-			for (; parent_idx < parent_count; parent_idx++) {
-				if (parent_range[parent_idx].seq2 <= parent_uid)
-					continue;
-				if (parent_uid < parent_range[parent_idx].seq1)
-					parent_uid = parent_range[parent_idx].seq1;
-				else
-					parent_uid++;
-				break;
+		while (seq1 <= seq2 && parent_idx < parent_count) {
+			parent_len = parent_range[parent_idx].seq2 -
+				parent_range[parent_idx].seq1 + 1;
+			if (seq1 - parent_seq >= parent_len) {
+				/* skip over the whole parent range */
+				parent_seq += parent_len;
+				parent_idx++;
+				continue;
 			}
-			diff--;
-		}
-		diff = seq2 - seq1 + 1;
-		while (diff > 0) {
-			if (unlikely(parent_uid == (uint32_t)-1)) {
-				i_error("broken UID ranges");
-				ret = -1;
-				break;
-			}
-			seq_range_array_add(&dest_uids, parent_uid);
-			for (; parent_idx < parent_count; parent_idx++) {
-				if (parent_range[parent_idx].seq2 <= parent_uid)
-					continue;
-				if (parent_uid < parent_range[parent_idx].seq1)
-					parent_uid = parent_range[parent_idx].seq1;
-				else
-					parent_uid++;
-				break;
-			}
-			diff--;
-		}
 
-		prev_seq = seq2 + 1;
+			uid1 = parent_range[parent_idx].seq1 +
+				(seq1 - parent_seq);
+			last_seq = I_MIN(seq2, parent_seq + parent_len - 1);
+			seq_range_array_add_range(&dest_uids, uid1,
+						  uid1 + (last_seq - seq1));
+			seq1 = last_seq + 1;
+		}
 	}
 
 	buffer_set_used_size(uids->arr.buffer, 0);
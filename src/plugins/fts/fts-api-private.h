@@ -79,6 +79,8 @@ struct fts_backend_update_context {
 	normalizer_func_t *normalizer;
 
 	struct mailbox *cur_box, *backend_box;
+	/* non-NULL if fts_index_pipeline is enabled */
+	struct fts_build_queue *build_queue;
 
 	unsigned int build_key_open:1;
 	unsigned int failed:1;
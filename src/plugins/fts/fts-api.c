@@ -8,8 +8,10 @@
 #include "mail-storage-private.h"
 #include "mailbox-list-iter.h"
 #include "mail-search.h"
+#include "mail-user.h"
 #include "../virtual/virtual-storage.h"
 #include "fts-api-private.h"
+#include "fts-build-mail.h"
 
 static ARRAY(const struct fts_backend *) backends;
 
@@ -112,6 +114,8 @@ struct fts_backend_update_context *
 fts_backend_update_init(struct fts_backend *backend)
 {
 	struct fts_backend_update_context *ctx;
+	const char *value;
+	unsigned int max_parsers;
 
 	i_assert(!backend->updating);
 
@@ -119,9 +123,27 @@ fts_backend_update_init(struct fts_backend *backend)
 	ctx = backend->v.update_init(backend);
 	if ((backend->flags & FTS_BACKEND_FLAG_NORMALIZE_INPUT) != 0)
 		ctx->normalizer = backend->ns->user->default_normalizer;
+
+	value = mail_user_plugin_getenv(backend->ns->user,
+					"fts_index_pipeline");
+	if (value != NULL && str_to_uint(value, &max_parsers) < 0) {
+		i_error("fts: Invalid fts_index_pipeline setting: %s", value);
+		max_parsers = 0;
+	}
+	if (value != NULL && max_parsers > 0)
+		ctx->build_queue = fts_build_queue_init(ctx, max_parsers);
 	return ctx;
 }
 
+static void
+fts_backend_update_flush_queue(struct fts_backend_update_context *ctx)
+{
+	if (ctx->build_queue != NULL) {
+		if (fts_build_queue_flush(ctx->build_queue) < 0)
+			ctx->failed = TRUE;
+	}
+}
+
 static void fts_backend_set_cur_mailbox(struct fts_backend_update_context *ctx)
 {
 	fts_backend_update_unset_build_key(ctx);
@@ -139,6 +161,10 @@ int fts_backend_update_deinit(struct fts_backend_update_context **_ctx)
 
 	*_ctx = NULL;
 
+	if (ctx->build_queue != NULL) {
+		fts_backend_update_flush_queue(ctx);
+		fts_build_queue_deinit(&ctx->build_queue);
+	}
 	ctx->cur_box = NULL;
 	fts_backend_set_cur_mailbox(ctx);
 
@@ -150,6 +176,10 @@ int fts_backend_update_deinit(struct fts_backend_update_context **_ctx)
 void fts_backend_update_set_mailbox(struct fts_backend_update_context *ctx,
 				    struct mailbox *box)
 {
+	if (box != ctx->cur_box) {
+		/* the queued mails belong to the previous mailbox */
+		fts_backend_update_flush_queue(ctx);
+	}
 	if (ctx->backend_box != NULL && box != ctx->backend_box) {
 		/* make sure we don't reference the backend box anymore */
 		ctx->backend->v.update_set_mailbox(ctx, NULL);
@@ -161,6 +191,7 @@ void fts_backend_update_set_mailbox(struct fts_backend_update_context *ctx,
 void fts_backend_update_expunge(struct fts_backend_update_context *ctx,
 				uint32_t uid)
 {
+	fts_backend_update_flush_queue(ctx);
 	fts_backend_set_cur_mailbox(ctx);
 	ctx->backend->v.update_expunge(ctx, uid);
 }
@@ -15,7 +15,10 @@ enum fts_lookup_flags {
 	FTS_LOOKUP_FLAG_AND_ARGS	= 0x01,
 	/* Require exact matching for non-fuzzy search args by returning all
 	   such matches as maybe_uids instead of definite_uids */
-	FTS_LOOKUP_FLAG_NO_AUTO_FUZZY	= 0x02
+	FTS_LOOKUP_FLAG_NO_AUTO_FUZZY	= 0x02,
+	/* The search results' relevancy scores are wanted. Backends for
+	   which scoring is expensive may skip it without this flag. */
+	FTS_LOOKUP_FLAG_SCORES		= 0x04
 };
 
 enum fts_backend_build_key_type {
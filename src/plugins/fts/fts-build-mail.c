@@ -1,6 +1,7 @@
 /* Copyright (c) 2006-2014 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "istream.h"
 #include "buffer.h"
 #include "str.h"
@@ -20,9 +21,57 @@
    wherever */
 #define MAX_WORD_SIZE 1024
 
+/* flush the oldest queued mails when the queue grows larger than these */
+#define FTS_BUILD_QUEUE_MAX_MAILS 128
+#define FTS_BUILD_QUEUE_MAX_BYTES (1024*1024*16)
+
+enum fts_build_op_type {
+	FTS_BUILD_OP_SET_KEY,
+	FTS_BUILD_OP_UNSET_KEY,
+	FTS_BUILD_OP_HDR_DATA,
+	FTS_BUILD_OP_BODY_DATA,
+	FTS_BUILD_OP_BODY_PARSER
+};
+
+/* A backend call recorded for a queued mail */
+struct fts_build_op {
+	enum fts_build_op_type type;
+
+	struct fts_backend_build_key key;
+	/* HDR_DATA and BODY_DATA are stored in the mail's data buffer */
+	size_t data_offset, data_size;
+	bool last;
+	/* BODY_PARSER's output hasn't been read yet */
+	struct fts_parser *parser;
+};
+
+struct fts_build_queued_mail {
+	/* the message parts that the keys point to are also in this pool */
+	pool_t pool;
+	ARRAY(struct fts_build_op) ops;
+	buffer_t *data;
+
+	unsigned int parser_count;
+};
+
+struct fts_build_queue {
+	struct fts_backend_update_context *update_ctx;
+	unsigned int max_parsers;
+
+	ARRAY(struct fts_build_queued_mail *) mails;
+	size_t queued_bytes;
+	/* number of parsers whose output hasn't been read yet */
+	unsigned int parser_count;
+
+	bool failed;
+};
+
 struct fts_mail_build_context {
 	struct mail *mail;
 	struct fts_backend_update_context *update_ctx;
+	/* with a queue the backend calls are recorded to qmail */
+	struct fts_build_queue *queue;
+	struct fts_build_queued_mail *qmail;
 
 	char *content_type, *content_disposition;
 	struct fts_parser *body_parser;
@@ -30,6 +79,76 @@ struct fts_mail_build_context {
 	buffer_t *word_buf;
 };
 
+static struct fts_build_op *
+fts_build_op_add(struct fts_mail_build_context *ctx,
+		 enum fts_build_op_type type)
+{
+	struct fts_build_op *op;
+
+	op = array_append_space(&ctx->qmail->ops);
+	op->type = type;
+	return op;
+}
+
+static void
+fts_build_op_add_data(struct fts_mail_build_context *ctx,
+		      enum fts_build_op_type type,
+		      const unsigned char *data, size_t size, bool last)
+{
+	struct fts_build_op *op;
+
+	op = fts_build_op_add(ctx, type);
+	op->data_offset = ctx->qmail->data->used;
+	op->data_size = size;
+	op->last = last;
+	buffer_append(ctx->qmail->data, data, size);
+}
+
+static bool
+fts_build_set_key(struct fts_mail_build_context *ctx,
+		  const struct fts_backend_build_key *key)
+{
+	pool_t pool;
+	struct fts_build_op *op;
+
+	if (ctx->qmail == NULL)
+		return fts_backend_update_set_build_key(ctx->update_ctx, key);
+
+	/* the backend decides whether it wants the key only when the
+	   queued mail is built */
+	pool = ctx->qmail->pool;
+	op = fts_build_op_add(ctx, FTS_BUILD_OP_SET_KEY);
+	op->key = *key;
+	op->key.hdr_name = p_strdup(pool, key->hdr_name);
+	op->key.body_content_type = p_strdup(pool, key->body_content_type);
+	op->key.body_content_disposition =
+		p_strdup(pool, key->body_content_disposition);
+	return TRUE;
+}
+
+static void fts_build_unset_key(struct fts_mail_build_context *ctx)
+{
+	if (ctx->qmail == NULL)
+		fts_backend_update_unset_build_key(ctx->update_ctx);
+	else
+		(void)fts_build_op_add(ctx, FTS_BUILD_OP_UNSET_KEY);
+}
+
+static void
+fts_build_hdr_more(struct fts_mail_build_context *ctx,
+		   const unsigned char *data, size_t size)
+{
+	if (ctx->qmail == NULL) {
+		(void)fts_backend_update_build_more(ctx->update_ctx,
+						    data, size);
+	} else {
+		fts_build_op_add_data(ctx, FTS_BUILD_OP_HDR_DATA,
+				      data, size, FALSE);
+	}
+}
+
+static bool fts_build_queue_reserve_parser(struct fts_build_queue *queue);
+
 static void fts_build_parse_content_type(struct fts_mail_build_context *ctx,
 					 const struct message_header_line *hdr)
 {
@@ -91,8 +210,7 @@ fts_build_unstructured_header(struct fts_mail_build_context *ctx,
 			buf[i] = data[i];
 		}
 	}
-	(void)fts_backend_update_build_more(ctx->update_ctx,
-					    data, hdr->full_value_len);
+	fts_build_hdr_more(ctx, data, hdr->full_value_len);
 	i_free(buf);
 }
 
@@ -114,7 +232,7 @@ static void fts_build_mail_header(struct fts_mail_build_context *ctx,
 	key.part = block->part;
 	key.hdr_name = hdr->name;
 
-	if (!fts_backend_update_set_build_key(ctx->update_ctx, &key))
+	if (!fts_build_set_key(ctx, &key))
 		return;
 
 	if (!message_header_is_address(hdr->name)) {
@@ -133,9 +251,7 @@ static void fts_build_mail_header(struct fts_mail_build_context *ctx,
 		str = t_str_new(hdr->full_value_len);
 		message_address_write(str, addr);
 
-		(void)fts_backend_update_build_more(ctx->update_ctx,
-						    str_data(str),
-						    str_len(str));
+		fts_build_hdr_more(ctx, str_data(str), str_len(str));
 	} T_END;
 }
 
@@ -184,7 +300,13 @@ fts_build_body_begin(struct fts_mail_build_context *ctx,
 	}
 	key.body_content_type = content_type;
 	key.body_content_disposition = ctx->content_disposition;
-	return fts_backend_update_set_build_key(ctx->update_ctx, &key);
+	if (!fts_build_set_key(ctx, &key)) {
+		/* backend doesn't want this part */
+		if (ctx->body_parser != NULL)
+			fts_parser_deinit(&ctx->body_parser);
+		return FALSE;
+	}
+	return TRUE;
 }
 
 static int fts_build_body_block(struct fts_mail_build_context *ctx,
@@ -194,6 +316,12 @@ static int fts_build_body_block(struct fts_mail_build_context *ctx,
 
 	i_assert(block->hdr == NULL);
 
+	if (ctx->qmail != NULL) {
+		fts_build_op_add_data(ctx, FTS_BUILD_OP_BODY_DATA,
+				      block->data, block->size, last);
+		return 0;
+	}
+
 	if ((ctx->update_ctx->backend->flags &
 	     FTS_BACKEND_FLAG_BUILD_FULL_WORDS) == 0) {
 		return fts_backend_update_build_more(ctx->update_ctx,
@@ -264,9 +392,28 @@ static int fts_body_parser_finish(struct fts_mail_build_context *ctx)
 	return ret;
 }
 
+static int fts_body_parser_end(struct fts_mail_build_context *ctx)
+{
+	struct fts_build_op *op;
+
+	if (ctx->qmail == NULL || ctx->body_parser->v.input_end == NULL ||
+	    !fts_build_queue_reserve_parser(ctx->queue))
+		return fts_body_parser_finish(ctx);
+
+	/* the extraction continues in the background while the following
+	   mails are parsed. its output is read when this mail is built. */
+	fts_parser_input_end(ctx->body_parser);
+	op = fts_build_op_add(ctx, FTS_BUILD_OP_BODY_PARSER);
+	op->parser = ctx->body_parser;
+	ctx->body_parser = NULL;
+	ctx->qmail->parser_count++;
+	return 0;
+}
+
 static int
 fts_build_mail_real(struct fts_backend_update_context *update_ctx,
-		    struct mail *mail)
+		    struct mail *mail, struct fts_build_queue *queue,
+		    struct fts_build_queued_mail *qmail)
 {
 	struct fts_mail_build_context ctx;
 	struct istream *input;
@@ -284,9 +431,12 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 	memset(&ctx, 0, sizeof(ctx));
 	ctx.update_ctx = update_ctx;
 	ctx.mail = mail;
+	ctx.queue = queue;
+	ctx.qmail = qmail;
 
 	prev_part = NULL;
-	parser = message_parser_init(pool_datastack_create(), input,
+	parser = message_parser_init(qmail != NULL ? qmail->pool :
+				     pool_datastack_create(), input,
 				     MESSAGE_HEADER_PARSER_FLAG_CLEAN_ONELINE,
 				     0);
 
@@ -304,13 +454,13 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 			/* body part changed. we're now parsing the end of
 			   boundary, possibly followed by message epilogue */
 			if (ctx.body_parser != NULL) {
-				if (fts_body_parser_finish(&ctx) < 0) {
+				if (fts_body_parser_end(&ctx) < 0) {
 					ret = -1;
 					break;
 				}
 			}
 			message_decoder_set_return_binary(decoder, FALSE);
-			fts_backend_update_unset_build_key(update_ctx);
+			fts_build_unset_key(&ctx);
 			prev_part = raw_block.part;
 			i_free_and_null(ctx.content_type);
 			i_free_and_null(ctx.content_disposition);
@@ -358,7 +508,7 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 	}
 	if (ctx.body_parser != NULL) {
 		if (ret == 0)
-			ret = fts_body_parser_finish(&ctx);
+			ret = fts_body_parser_end(&ctx);
 		else
 			fts_parser_deinit(&ctx.body_parser);
 	}
@@ -377,13 +527,210 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 	return ret < 0 ? -1 : 1;
 }
 
+static int
+fts_build_queued_mail_replay(struct fts_backend_update_context *update_ctx,
+			     struct fts_build_queued_mail *qmail)
+{
+	struct fts_mail_build_context ctx;
+	struct message_block block;
+	struct fts_build_op *op;
+	bool wanted = FALSE;
+	int ret = 0;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.update_ctx = update_ctx;
+
+	array_foreach_modifiable(&qmail->ops, op) {
+		switch (op->type) {
+		case FTS_BUILD_OP_SET_KEY:
+			wanted = fts_backend_update_set_build_key(update_ctx,
+								  &op->key);
+			break;
+		case FTS_BUILD_OP_UNSET_KEY:
+			fts_backend_update_unset_build_key(update_ctx);
+			wanted = FALSE;
+			break;
+		case FTS_BUILD_OP_HDR_DATA:
+			if (!wanted || ret < 0)
+				break;
+			(void)fts_backend_update_build_more(update_ctx,
+				CONST_PTR_OFFSET(qmail->data->data,
+						 op->data_offset),
+				op->data_size);
+			break;
+		case FTS_BUILD_OP_BODY_DATA:
+			if (!wanted || ret < 0)
+				break;
+			memset(&block, 0, sizeof(block));
+			block.data = CONST_PTR_OFFSET(qmail->data->data,
+						      op->data_offset);
+			block.size = op->data_size;
+			if (fts_build_body_block(&ctx, &block, op->last) < 0)
+				ret = -1;
+			break;
+		case FTS_BUILD_OP_BODY_PARSER:
+			ctx.body_parser = op->parser;
+			op->parser = NULL;
+			if (wanted && ret == 0) {
+				if (fts_body_parser_finish(&ctx) < 0)
+					ret = -1;
+			} else {
+				fts_parser_deinit(&ctx.body_parser);
+			}
+			break;
+		}
+	}
+	fts_backend_update_unset_build_key(update_ctx);
+	if (ctx.word_buf != NULL)
+		buffer_free(&ctx.word_buf);
+	return ret;
+}
+
+static void
+fts_build_queued_mail_free(struct fts_build_queue *queue,
+			   struct fts_build_queued_mail **_qmail)
+{
+	struct fts_build_queued_mail *qmail = *_qmail;
+	struct fts_build_op *op;
+
+	*_qmail = NULL;
+
+	array_foreach_modifiable(&qmail->ops, op) {
+		if (op->parser != NULL)
+			fts_parser_deinit(&op->parser);
+	}
+	i_assert(queue->parser_count >= qmail->parser_count);
+	queue->parser_count -= qmail->parser_count;
+	i_assert(queue->queued_bytes >= qmail->data->used);
+	queue->queued_bytes -= qmail->data->used;
+	pool_unref(&qmail->pool);
+}
+
+static void fts_build_queue_flush_head(struct fts_build_queue *queue)
+{
+	struct fts_build_queued_mail *qmail;
+	int ret;
+
+	qmail = *(struct fts_build_queued_mail *const *)
+		array_idx(&queue->mails, 0);
+	array_delete(&queue->mails, 0, 1);
+
+	T_BEGIN {
+		ret = fts_build_queued_mail_replay(queue->update_ctx, qmail);
+	} T_END;
+	if (ret < 0)
+		queue->failed = TRUE;
+	fts_build_queued_mail_free(queue, &qmail);
+}
+
+static bool fts_build_queue_reserve_parser(struct fts_build_queue *queue)
+{
+	while (queue->parser_count >= queue->max_parsers &&
+	       array_count(&queue->mails) > 0)
+		fts_build_queue_flush_head(queue);
+	if (queue->parser_count >= queue->max_parsers) {
+		/* the current mail alone has this many parsers running */
+		return FALSE;
+	}
+	queue->parser_count++;
+	return TRUE;
+}
+
+static int fts_build_queue_mail(struct fts_build_queue *queue,
+				struct mail *mail)
+{
+	struct fts_build_queued_mail *qmail;
+	pool_t pool;
+	int ret;
+
+	pool = pool_alloconly_create("fts build queued mail", 4096);
+	qmail = p_new(pool, struct fts_build_queued_mail, 1);
+	qmail->pool = pool;
+	p_array_init(&qmail->ops, pool, 32);
+	qmail->data = buffer_create_dynamic(pool, 1024);
+
+	T_BEGIN {
+		ret = fts_build_mail_real(queue->update_ctx, mail,
+					  queue, qmail);
+	} T_END;
+	queue->queued_bytes += qmail->data->used;
+
+	if (ret < 0)
+		fts_build_queued_mail_free(queue, &qmail);
+	else if (qmail->parser_count == 0 &&
+		 array_count(&queue->mails) == 0) {
+		/* nothing to wait for */
+		array_append(&queue->mails, &qmail, 1);
+		fts_build_queue_flush_head(queue);
+	} else {
+		array_append(&queue->mails, &qmail, 1);
+	}
+
+	while (array_count(&queue->mails) > FTS_BUILD_QUEUE_MAX_MAILS ||
+	       queue->queued_bytes > FTS_BUILD_QUEUE_MAX_BYTES)
+		fts_build_queue_flush_head(queue);
+
+	if (queue->failed) {
+		queue->failed = FALSE;
+		return -1;
+	}
+	return ret;
+}
+
+struct fts_build_queue *
+fts_build_queue_init(struct fts_backend_update_context *update_ctx,
+		     unsigned int max_parsers)
+{
+	struct fts_build_queue *queue;
+
+	i_assert(max_parsers > 0);
+
+	queue = i_new(struct fts_build_queue, 1);
+	queue->update_ctx = update_ctx;
+	queue->max_parsers = max_parsers;
+	i_array_init(&queue->mails, 16);
+	return queue;
+}
+
+int fts_build_queue_flush(struct fts_build_queue *queue)
+{
+	while (array_count(&queue->mails) > 0)
+		fts_build_queue_flush_head(queue);
+
+	if (queue->failed) {
+		queue->failed = FALSE;
+		return -1;
+	}
+	return 0;
+}
+
+void fts_build_queue_deinit(struct fts_build_queue **_queue)
+{
+	struct fts_build_queue *queue = *_queue;
+	struct fts_build_queued_mail *const *qmailp;
+	struct fts_build_queued_mail *qmail;
+
+	*_queue = NULL;
+
+	array_foreach(&queue->mails, qmailp) {
+		qmail = *qmailp;
+		fts_build_queued_mail_free(queue, &qmail);
+	}
+	i_assert(queue->parser_count == 0);
+	array_free(&queue->mails);
+	i_free(queue);
+}
+
 int fts_build_mail(struct fts_backend_update_context *update_ctx,
 		   struct mail *mail)
 {
 	int ret;
 
+	if (update_ctx->build_queue != NULL)
+		return fts_build_queue_mail(update_ctx->build_queue, mail);
+
 	T_BEGIN {
-		ret = fts_build_mail_real(update_ctx, mail);
+		ret = fts_build_mail_real(update_ctx, mail, NULL, NULL);
 	} T_END;
 	return ret;
 }
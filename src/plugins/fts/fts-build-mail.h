@@ -1,6 +1,21 @@
 #ifndef FTS_BUILD_MAIL_H
 #define FTS_BUILD_MAIL_H
 
+/* Pipelined building: The mails are parsed and decoded as they come, but
+   the text of attachments whose extraction happens outside this process
+   is read only later, so that up to max_parsers extractions run in
+   parallel with the parsing. The backend is still called for one mail at
+   a time in the original order, so the recorded backend calls of the
+   following mails are queued until then. */
+struct fts_build_queue *
+fts_build_queue_init(struct fts_backend_update_context *update_ctx,
+		     unsigned int max_parsers);
+/* Send all the queued mails to the backend. Returns 0 if ok, -1 if
+   building any of them failed. */
+int fts_build_queue_flush(struct fts_build_queue *queue);
+/* Drop any queued mails without building them. */
+void fts_build_queue_deinit(struct fts_build_queue **queue);
+
 int fts_build_mail(struct fts_backend_update_context *update_ctx,
 		   struct mail *mail);
 
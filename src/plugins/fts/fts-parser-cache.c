@@ -0,0 +1,300 @@
+/* Copyright (c) 2014 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "buffer.h"
+#include "hex-binary.h"
+#include "sha2.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "safe-mkstemp.h"
+#include "mkdir-parents.h"
+#include "message-parser.h"
+#include "mail-user.h"
+#include "fts-parser.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+/* Input is kept in memory until its hash is known, so a cache hit doesn't
+   need to start the extractor at all. Larger input is given to the
+   extractor immediately, but its output is still cached afterwards. */
+#define FTS_PARSER_CACHE_MAX_INPUT_SIZE (1024*1024*8)
+/* Don't cache larger outputs */
+#define FTS_PARSER_CACHE_MAX_OUTPUT_SIZE (1024*1024*8)
+
+struct cache_fts_parser {
+	struct fts_parser parser;
+	struct fts_parser *parent;
+
+	char *dir;
+	struct sha256_ctx hash;
+	char *path;
+
+	/* Input that hasn't been given to the parent parser yet. NULL once
+	   it has been. */
+	buffer_t *input;
+	/* Output returned so far, or cached output that is returned.
+	   NULL if the output isn't cached. */
+	buffer_t *output;
+
+	bool input_finished;
+	bool cache_hit;
+	bool output_sent;
+};
+
+static void
+fts_parser_cache_parent_more(struct cache_fts_parser *parser,
+			     struct message_block *block)
+{
+	parser->parent->v.more(parser->parent, block);
+	if (parser->parent->failed)
+		parser->parser.failed = TRUE;
+
+	if (parser->output == NULL)
+		return;
+	if (parser->output->used + block->size >
+	    FTS_PARSER_CACHE_MAX_OUTPUT_SIZE) {
+		/* too large, don't cache */
+		buffer_free(&parser->output);
+	} else {
+		buffer_append(parser->output, block->data, block->size);
+	}
+}
+
+static void fts_parser_cache_send_input(struct cache_fts_parser *parser)
+{
+	struct message_block block;
+
+	if (parser->input->used > 0) {
+		memset(&block, 0, sizeof(block));
+		block.data = parser->input->data;
+		block.size = parser->input->used;
+		fts_parser_cache_parent_more(parser, &block);
+		/* the wrapped parsers return their output only after the
+		   input has ended */
+		i_assert(block.size == 0);
+	}
+	buffer_free(&parser->input);
+}
+
+static int fts_parser_cache_read(struct cache_fts_parser *parser)
+{
+	struct stat st;
+	void *data;
+	int fd, ret;
+
+	fd = open(parser->path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		i_error("open(%s) failed: %m", parser->path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", parser->path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (st.st_size == 0 ||
+	    st.st_size > FTS_PARSER_CACHE_MAX_OUTPUT_SIZE) {
+		/* we never write these */
+		i_close_fd(&fd);
+		return 0;
+	}
+
+	buffer_set_used_size(parser->output, 0);
+	data = buffer_append_space_unsafe(parser->output, st.st_size);
+	ret = read_full(fd, data, st.st_size);
+	if (ret <= 0) {
+		if (ret < 0)
+			i_error("read(%s) failed: %m", parser->path);
+		else
+			i_error("read(%s) failed: Unexpected EOF",
+				parser->path);
+		buffer_set_used_size(parser->output, 0);
+	}
+	i_close_fd(&fd);
+	if (ret <= 0)
+		return -1;
+
+	/* the cache is pruned by mtime, so keep the used files */
+	if (utime(parser->path, NULL) < 0 && errno != ENOENT)
+		i_error("utime(%s) failed: %m", parser->path);
+	return 1;
+}
+
+static void fts_parser_cache_write(struct cache_fts_parser *parser)
+{
+	string_t *temp_path;
+	const char *dir;
+	int fd;
+
+	if (parser->parser.failed) {
+		/* the output may be incomplete */
+		return;
+	}
+	if (parser->output == NULL || parser->output->used == 0) {
+		/* empty output is usually a failure in the extractor, which
+		   shouldn't be remembered */
+		return;
+	}
+
+	temp_path = t_str_new(256);
+	str_append(temp_path, parser->path);
+	fd = safe_mkstemp_hostpid(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1 && errno == ENOENT) {
+		dir = t_strdup_until(parser->path,
+				     strrchr(parser->path, '/'));
+		if (mkdir_parents(dir, 0700) < 0 && errno != EEXIST) {
+			i_error("mkdir_parents(%s) failed: %m", dir);
+			return;
+		}
+		str_truncate(temp_path, 0);
+		str_append(temp_path, parser->path);
+		fd = safe_mkstemp_hostpid(temp_path, 0600,
+					  (uid_t)-1, (gid_t)-1);
+	}
+	if (fd == -1) {
+		i_error("safe_mkstemp(%s) failed: %m", str_c(temp_path));
+		return;
+	}
+	if (write_full(fd, parser->output->data, parser->output->used) < 0) {
+		i_error("write(%s) failed: %m", str_c(temp_path));
+		i_close_fd(&fd);
+		if (unlink(str_c(temp_path)) < 0)
+			i_error("unlink(%s) failed: %m", str_c(temp_path));
+		return;
+	}
+	if (close(fd) < 0)
+		i_error("close(%s) failed: %m", str_c(temp_path));
+	if (rename(str_c(temp_path), parser->path) < 0) {
+		i_error("rename(%s, %s) failed: %m",
+			str_c(temp_path), parser->path);
+		if (unlink(str_c(temp_path)) < 0)
+			i_error("unlink(%s) failed: %m", str_c(temp_path));
+	}
+}
+
+static void fts_parser_cache_input_finish(struct cache_fts_parser *parser)
+{
+	unsigned char digest[SHA256_RESULTLEN];
+	const char *hex;
+
+	parser->input_finished = TRUE;
+
+	sha256_result(&parser->hash, digest);
+	hex = binary_to_hex(digest, sizeof(digest));
+	parser->path = i_strdup_printf("%s/%c%c/%s", parser->dir,
+				       hex[0], hex[1], hex);
+
+	if (parser->input != NULL && parser->output != NULL &&
+	    fts_parser_cache_read(parser) > 0) {
+		/* the parent parser never needs to see the input */
+		parser->cache_hit = TRUE;
+		buffer_free(&parser->input);
+		return;
+	}
+	if (parser->input != NULL)
+		fts_parser_cache_send_input(parser);
+}
+
+static void fts_parser_cache_more(struct fts_parser *_parser,
+				  struct message_block *block)
+{
+	struct cache_fts_parser *parser = (struct cache_fts_parser *)_parser;
+
+	if (block->size > 0) {
+		i_assert(!parser->input_finished);
+
+		sha256_loop(&parser->hash, block->data, block->size);
+		if (parser->input == NULL) {
+			fts_parser_cache_parent_more(parser, block);
+			return;
+		}
+		buffer_append(parser->input, block->data, block->size);
+		if (parser->input->used > FTS_PARSER_CACHE_MAX_INPUT_SIZE)
+			fts_parser_cache_send_input(parser);
+		block->size = 0;
+		return;
+	}
+
+	if (!parser->input_finished)
+		fts_parser_cache_input_finish(parser);
+	if (parser->cache_hit) {
+		if (!parser->output_sent) {
+			block->data = parser->output->data;
+			block->size = parser->output->used;
+			parser->output_sent = TRUE;
+		}
+		return;
+	}
+
+	fts_parser_cache_parent_more(parser, block);
+	if (block->size == 0) T_BEGIN {
+		fts_parser_cache_write(parser);
+	} T_END;
+}
+
+static void fts_parser_cache_input_end(struct fts_parser *_parser)
+{
+	struct cache_fts_parser *parser = (struct cache_fts_parser *)_parser;
+
+	if (!parser->input_finished)
+		fts_parser_cache_input_finish(parser);
+	if (!parser->cache_hit)
+		fts_parser_input_end(parser->parent);
+}
+
+static void fts_parser_cache_deinit(struct fts_parser *_parser)
+{
+	struct cache_fts_parser *parser = (struct cache_fts_parser *)_parser;
+
+	fts_parser_deinit(&parser->parent);
+	if (parser->input != NULL)
+		buffer_free(&parser->input);
+	if (parser->output != NULL)
+		buffer_free(&parser->output);
+	i_free(parser->path);
+	i_free(parser->dir);
+	i_free(parser);
+}
+
+struct fts_parser *
+fts_parser_cache_wrap(struct mail_user *user, const char *content_type,
+		      struct fts_parser *parent)
+{
+	struct cache_fts_parser *parser;
+	const char *dir;
+
+	dir = mail_user_plugin_getenv(user, "fts_parser_cache");
+	if (dir == NULL || dir[0] == '\0')
+		return parent;
+	dir = mail_user_home_expand(user, dir);
+
+	parser = i_new(struct cache_fts_parser, 1);
+	parser->parser.v = fts_parser_cache;
+	if (parent->v.input_end == NULL)
+		parser->parser.v.input_end = NULL;
+	parser->parent = parent;
+	parser->dir = i_strdup(dir);
+	parser->input = buffer_create_dynamic(default_pool, 4096);
+	parser->output = buffer_create_dynamic(default_pool, 4096);
+
+	/* the same data may be extracted differently depending on its
+	   type */
+	sha256_init(&parser->hash);
+	sha256_loop(&parser->hash, content_type, strlen(content_type) + 1);
+	return &parser->parser;
+}
+
+struct fts_parser_vfuncs fts_parser_cache = {
+	NULL,
+	fts_parser_cache_more,
+	fts_parser_cache_deinit,
+	NULL,
+	fts_parser_cache_input_end
+};
@@ -30,12 +30,15 @@ struct fts_parser_script_user {
 
 struct script_fts_parser {
 	struct fts_parser parser;
+	struct mail_user *user;
+	char *content_type;
 
+	/* -1 until the first input, so that a cached conversion doesn't
+	   run the script */
 	int fd;
 	char *path;
 
 	unsigned char outbuf[IO_BLOCK_SIZE];
-	bool failed;
 	bool shutdown;
 };
 
@@ -198,28 +201,54 @@ fts_parser_script_try_init(struct mail_user *user,
 			   const char *content_disposition)
 {
 	struct script_fts_parser *parser;
-	const char *filename, *path, *cmd;
-	int fd;
+	const char *filename;
 
 	parse_content_disposition(content_disposition, &filename);
 	if (script_support_content(user, &content_type, filename) <= 0)
 		return NULL;
 
-	fd = script_connect(user, &path);
-	if (fd == -1)
-		return NULL;
-	cmd = t_strdup_printf(SCRIPT_HANDSHAKE"%s\n\n", content_type);
+	parser = i_new(struct script_fts_parser, 1);
+	parser->parser.v = fts_parser_script;
+	parser->user = user;
+	parser->content_type = i_strdup(content_type);
+	parser->fd = -1;
+	return &parser->parser;
+}
+
+static int script_parser_connect(struct script_fts_parser *parser)
+{
+	const char *path, *cmd;
+	int fd;
+
+	if (parser->parser.failed)
+		return -1;
+	if (parser->fd != -1)
+		return 0;
+
+	fd = script_connect(parser->user, &path);
+	if (fd == -1) {
+		parser->parser.failed = TRUE;
+		return -1;
+	}
+	cmd = t_strdup_printf(SCRIPT_HANDSHAKE"%s\n\n", parser->content_type);
 	if (write_full(fd, cmd, strlen(cmd)) < 0) {
 		i_error("write(%s) failed: %m", path);
 		i_close_fd(&fd);
-		return NULL;
+		parser->parser.failed = TRUE;
+		return -1;
 	}
-
-	parser = i_new(struct script_fts_parser, 1);
-	parser->parser.v = fts_parser_script;
 	parser->path = i_strdup(path);
 	parser->fd = fd;
-	return &parser->parser;
+	return 0;
+}
+
+static void script_input_end(struct script_fts_parser *parser)
+{
+	if (!parser->shutdown) {
+		if (shutdown(parser->fd, SHUT_WR) < 0)
+			i_error("shutdown(%s) failed: %m", parser->path);
+		parser->shutdown = TRUE;
+	}
 }
 
 static void fts_parser_script_more(struct fts_parser *_parser,
@@ -230,23 +259,22 @@ static void fts_parser_script_more(struct fts_parser *_parser,
 
 	if (block->size > 0) {
 		/* first we'll send everything to the script */
-		if (!parser->failed &&
+		if (script_parser_connect(parser) == 0 &&
 		    write_full(parser->fd, block->data, block->size) < 0) {
 			i_error("write(%s) failed: %m", parser->path);
-			parser->failed = TRUE;
+			parser->parser.failed = TRUE;
 		}
 		block->size = 0;
 	} else {
-		if (!parser->shutdown) {
-			if (shutdown(parser->fd, SHUT_WR) < 0)
-				i_error("shutdown(%s) failed: %m", parser->path);
-			parser->shutdown = TRUE;
-		}
+		if (script_parser_connect(parser) < 0)
+			return;
+		script_input_end(parser);
 		/* read the result from the script */
 		ret = read(parser->fd, parser->outbuf, sizeof(parser->outbuf));
-		if (ret < 0)
+		if (ret < 0) {
 			i_error("read(%s) failed: %m", parser->path);
-		else {
+			parser->parser.failed = TRUE;
+		} else {
 			block->data = parser->outbuf;
 			block->size = ret;
 		}
@@ -257,15 +285,26 @@ static void fts_parser_script_deinit(struct fts_parser *_parser)
 {
 	struct script_fts_parser *parser = (struct script_fts_parser *)_parser;
 
-	if (close(parser->fd) < 0)
+	if (parser->fd != -1 && close(parser->fd) < 0)
 		i_error("close(%s) failed: %m", parser->path);
+	i_free(parser->content_type);
 	i_free(parser->path);
 	i_free(parser);
 }
 
+static void fts_parser_script_input_end(struct fts_parser *_parser)
+{
+	struct script_fts_parser *parser = (struct script_fts_parser *)_parser;
+
+	/* the script starts converting once it sees EOF */
+	if (script_parser_connect(parser) == 0)
+		script_input_end(parser);
+}
+
 struct fts_parser_vfuncs fts_parser_script = {
 	fts_parser_script_try_init,
 	fts_parser_script_more,
 	fts_parser_script_deinit,
-	NULL
+	NULL,
+	fts_parser_script_input_end
 };
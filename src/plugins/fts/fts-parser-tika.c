@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "buffer.h"
 #include "istream.h"
 #include "module-context.h"
 #include "http-url.h"
@@ -13,9 +14,16 @@
 #define TIKA_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_parser_tika_user_module)
 
+/* With fts_index_pipeline each attachment is buffered in memory until it
+   can be sent as a whole. Larger attachments are streamed to Tika
+   synchronously instead. */
+#define TIKA_PIPELINE_MAX_PAYLOAD_SIZE (1024*1024)
+
 struct fts_parser_tika_user {
 	union mail_user_module_context module_ctx;
 	struct http_url *http_url;
+	/* fts_index_pipeline value, 0 if disabled */
+	unsigned int max_parsers;
 };
 
 struct tika_fts_parser {
@@ -23,11 +31,17 @@ struct tika_fts_parser {
 	struct mail_user *user;
 	struct http_client_request *http_req;
 
+	/* with fts_index_pipeline the attachment is sent to Tika as a whole
+	   once it has ended. NULL if it's being streamed instead. */
+	buffer_t *request_payload;
+
 	struct ioloop *ioloop;
 	struct io *io;
 	struct istream *payload;
 
-	bool failed;
+	bool pipelined;
+	bool submitted;
+	bool waiting;
 };
 
 static struct http_client *tika_http_client = NULL;
@@ -35,11 +49,12 @@ static MODULE_CONTEXT_DEFINE_INIT(fts_parser_tika_user_module,
 				  &mail_user_module_register);
 
 static int
-tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
+tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r,
+			 unsigned int *max_parsers_r)
 {
 	struct fts_parser_tika_user *tuser = TIKA_USER_CONTEXT(user);
 	struct http_client_settings http_set;
-	const char *url, *error;
+	const char *url, *value, *error;
 
 	url = mail_user_plugin_getenv(user, "fts_tika");
 	if (url == NULL) {
@@ -49,12 +64,17 @@ tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
 
 	if (tuser != NULL) {
 		*http_url_r = tuser->http_url;
+		*max_parsers_r = tuser->max_parsers;
 		return *http_url_r == NULL ? -1 : 0;
 	}
 
 	tuser = p_new(user->pool, struct fts_parser_tika_user, 1);
 	MODULE_CONTEXT_SET(user, fts_parser_tika_user_module, tuser);
 
+	value = mail_user_plugin_getenv(user, "fts_index_pipeline");
+	if (value != NULL && str_to_uint(value, &tuser->max_parsers) < 0)
+		tuser->max_parsers = 0;
+
 	if (http_url_parse(url, NULL, 0, user->pool,
 			   &tuser->http_url, &error) < 0) {
 		i_error("fts_tika: Failed to parse HTTP url %s: %s", url, error);
@@ -62,9 +82,13 @@ tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
 	}
 
 	if (tika_http_client == NULL) {
+		/* each extraction that fts_index_pipeline keeps running in
+		   the background needs its own connection, since its
+		   response isn't read until later. */
 		memset(&http_set, 0, sizeof(http_set));
 		http_set.max_idle_time_msecs = 100;
-		http_set.max_parallel_connections = 1;
+		http_set.max_parallel_connections =
+			I_MAX(tuser->max_parsers, 1);
 		http_set.max_pipelined_requests = 1;
 		http_set.max_redirects = 1;
 		http_set.max_attempts = 3;
@@ -72,6 +96,7 @@ tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
 		tika_http_client = http_client_init(&http_set);
 	}
 	*http_url_r = tuser->http_url;
+	*max_parsers_r = tuser->max_parsers;
 	return 0;
 }
 
@@ -105,11 +130,14 @@ fts_tika_parser_response(const struct http_response *response,
 		i_error("fts_tika: PUT %s failed: %u %s",
 			mail_user_plugin_getenv(parser->user, "fts_tika"),
 			response->status, response->reason);
-		parser->failed = TRUE;
+		parser->parser.failed = TRUE;
 		break;
 	}
 	parser->http_req = NULL;
-	io_loop_stop(current_ioloop);
+	/* without pipelining this is the only request, and
+	   http_client_wait() is waiting for it */
+	if (parser->waiting || !parser->pipelined)
+		io_loop_stop(current_ioloop);
 }
 
 static struct fts_parser *
@@ -119,8 +147,9 @@ fts_parser_tika_try_init(struct mail_user *user, const char *content_type,
 	struct tika_fts_parser *parser;
 	struct http_url *http_url;
 	struct http_client_request *http_req;
+	unsigned int max_parsers;
 
-	if (tika_get_http_client_url(user, &http_url) < 0)
+	if (tika_get_http_client_url(user, &http_url, &max_parsers) < 0)
 		return NULL;
 
 	parser = i_new(struct tika_fts_parser, 1);
@@ -139,9 +168,80 @@ fts_parser_tika_try_init(struct mail_user *user, const char *content_type,
 	http_client_request_add_header(http_req, "Accept", "text/plain");
 
 	parser->http_req = http_req;
+	if (max_parsers > 0) {
+		parser->pipelined = TRUE;
+		parser->request_payload =
+			buffer_create_dynamic(default_pool, 8192);
+	}
 	return &parser->parser;
 }
 
+static void fts_parser_tika_submit(struct tika_fts_parser *parser)
+{
+	struct istream *input;
+
+	parser->submitted = TRUE;
+	input = i_stream_create_from_data(parser->request_payload->data,
+					  parser->request_payload->used);
+	http_client_request_set_payload(parser->http_req, input, FALSE);
+	i_stream_unref(&input);
+	/* the request is sent while waiting for any Tika response, so
+	   several requests may be processed at the same time */
+	http_client_request_submit(parser->http_req);
+}
+
+static void fts_parser_tika_wait(struct tika_fts_parser *parser)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+	struct ioloop *ioloop;
+
+	/* other requests' responses may arrive meanwhile, but their
+	   payloads are left unread until their parsers want them */
+	ioloop = io_loop_create();
+	http_client_switch_ioloop(tika_http_client);
+	parser->waiting = TRUE;
+	while (parser->payload == NULL && !parser->parser.failed)
+		io_loop_run(ioloop);
+	parser->waiting = FALSE;
+
+	io_loop_set_current(prev_ioloop);
+	http_client_switch_ioloop(tika_http_client);
+	io_loop_set_current(ioloop);
+	io_loop_destroy(&ioloop);
+}
+
+static void
+fts_parser_tika_send(struct tika_fts_parser *parser,
+		     const unsigned char *data, size_t size)
+{
+	if (!parser->parser.failed &&
+	    http_client_request_send_payload(&parser->http_req,
+					     data, size) < 0)
+		parser->parser.failed = TRUE;
+}
+
+static void
+fts_parser_tika_append(struct tika_fts_parser *parser,
+		       const unsigned char *data, size_t size)
+{
+	i_assert(!parser->submitted);
+
+	if (parser->request_payload == NULL) {
+		fts_parser_tika_send(parser, data, size);
+		return;
+	}
+	if (parser->request_payload->used + size <=
+	    TIKA_PIPELINE_MAX_PAYLOAD_SIZE) {
+		buffer_append(parser->request_payload, data, size);
+		return;
+	}
+	/* too large to keep in memory - stream the rest of it */
+	fts_parser_tika_send(parser, parser->request_payload->data,
+			     parser->request_payload->used);
+	fts_parser_tika_send(parser, data, size);
+	buffer_free(&parser->request_payload);
+}
+
 static void fts_parser_tika_more(struct fts_parser *_parser,
 				 struct message_block *block)
 {
@@ -152,29 +252,38 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 
 	if (block->size > 0) {
 		/* first we'll send everything to Tika */
-		if (!parser->failed &&
-		    http_client_request_send_payload(&parser->http_req,
-						     block->data,
-						     block->size) < 0)
-			parser->failed = TRUE;
+		fts_parser_tika_append(parser, block->data, block->size);
 		block->size = 0;
 		return;
 	}
 
 	if (parser->payload == NULL) {
 		/* read the result from Tika */
-		if (!parser->failed &&
-		    http_client_request_finish_payload(&parser->http_req) < 0)
-			parser->failed = TRUE;
-		if (!parser->failed && parser->payload == NULL)
-			http_client_wait(tika_http_client);
-		if (parser->failed)
+		if (parser->request_payload != NULL) {
+			if (!parser->submitted)
+				fts_parser_tika_submit(parser);
+			if (!parser->parser.failed && parser->payload == NULL)
+				fts_parser_tika_wait(parser);
+		} else {
+			if (!parser->parser.failed &&
+			    http_client_request_finish_payload(&parser->http_req) < 0)
+				parser->parser.failed = TRUE;
+			if (!parser->parser.failed && parser->payload == NULL) {
+				/* with pipelining other requests may be left
+				   pending, so wait only for this one */
+				if (parser->pipelined)
+					fts_parser_tika_wait(parser);
+				else
+					http_client_wait(tika_http_client);
+			}
+		}
+		if (parser->parser.failed)
 			return;
 		i_assert(parser->payload != NULL);
 	}
 	/* continue returning data from Tika */
 	while ((ret = i_stream_read_data(parser->payload, &data, &size, 0)) == 0) {
-		if (parser->failed)
+		if (parser->parser.failed)
 			return;
 		/* wait for more input from Tika */
 		if (parser->ioloop == NULL) {
@@ -194,6 +303,12 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 	} else {
 		/* finished */
 		i_assert(ret == -1);
+		if (parser->payload->stream_errno != 0) {
+			i_error("fts_tika: read(%s) failed: %s",
+				i_stream_get_name(parser->payload),
+				i_stream_get_error(parser->payload));
+			parser->parser.failed = TRUE;
+		}
 	}
 }
 
@@ -211,9 +326,19 @@ static void fts_parser_tika_deinit(struct fts_parser *_parser)
 	   free it. requires lib-http changes. */
 	if (parser->http_req != NULL)
 		http_client_request_abort(&parser->http_req);
+	if (parser->request_payload != NULL)
+		buffer_free(&parser->request_payload);
 	i_free(parser);
 }
 
+static void fts_parser_tika_input_end(struct fts_parser *_parser)
+{
+	struct tika_fts_parser *parser = (struct tika_fts_parser *)_parser;
+
+	if (parser->request_payload != NULL && !parser->submitted)
+		fts_parser_tika_submit(parser);
+}
+
 static void fts_parser_tika_unload(void)
 {
 	if (tika_http_client != NULL)
@@ -224,5 +349,6 @@ struct fts_parser_vfuncs fts_parser_tika = {
 	fts_parser_tika_try_init,
 	fts_parser_tika_more,
 	fts_parser_tika_deinit,
-	fts_parser_tika_unload
+	fts_parser_tika_unload,
+	fts_parser_tika_input_end
 };
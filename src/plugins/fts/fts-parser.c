@@ -27,8 +27,15 @@ bool fts_parser_init(struct mail_user *user,
 	for (i = 0; i < N_ELEMENTS(parsers); i++) {
 		*parser_r = parsers[i]->try_init(user, content_type,
 						 content_disposition);
-		if (*parser_r != NULL)
+		if (*parser_r != NULL) {
+			if (parsers[i] != &fts_parser_html) {
+				/* the external extractors are slow enough
+				   to be worth caching */
+				*parser_r = fts_parser_cache_wrap(user,
+						content_type, *parser_r);
+			}
 			return TRUE;
+		}
 	}
 	return FALSE;
 }
@@ -97,6 +104,12 @@ void fts_parser_deinit(struct fts_parser **_parser)
 		i_free(parser);
 }
 
+void fts_parser_input_end(struct fts_parser *parser)
+{
+	if (parser->v.input_end != NULL)
+		parser->v.input_end(parser);
+}
+
 void fts_parsers_unload(void)
 {
 	unsigned int i;
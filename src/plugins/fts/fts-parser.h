@@ -5,33 +5,56 @@ struct message_block;
 struct mail_user;
 
 struct fts_parser_vfuncs {
+	/* Don't contact the extractor yet. With fts_parser_cache the input
+	   is never given to the parser when its output is already cached. */
 	struct fts_parser *(*try_init)(struct mail_user *user,
 				       const char *content_type,
 				       const char *content_disposition);
 	void (*more)(struct fts_parser *parser, struct message_block *block);
 	void (*deinit)(struct fts_parser *parser);
 	void (*unload)(void);
+	/* Optional: The whole input has been given, but the output isn't
+	   needed yet. Parsers that do the conversion outside this process
+	   can start it here and have more() return the output later. */
+	void (*input_end)(struct fts_parser *parser);
 };
 
 struct fts_parser {
 	struct fts_parser_vfuncs v;
 	buffer_t *utf8_output;
+	/* Set by the parser when the conversion failed, so its output may
+	   be missing or incomplete. */
+	bool failed;
 };
 
 extern struct fts_parser_vfuncs fts_parser_html;
 extern struct fts_parser_vfuncs fts_parser_script;
 extern struct fts_parser_vfuncs fts_parser_tika;
+extern struct fts_parser_vfuncs fts_parser_cache;
 
 bool fts_parser_init(struct mail_user *user,
 		     const char *content_type, const char *content_disposition,
 		     struct fts_parser **parser_r);
 struct fts_parser *fts_parser_text_init(void);
+/* Wrap the parser so its output is cached under the fts_parser_cache
+   directory, keyed by the SHA256 of the content type and the input. Returns
+   the parser itself if the cache isn't enabled. Nothing is ever removed
+   from the cache, so the administrator must prune it. Cache hits update
+   the file's mtime, so e.g. "find -mtime +30 -delete" drops the unused
+   entries. */
+struct fts_parser *
+fts_parser_cache_wrap(struct mail_user *user, const char *content_type,
+		      struct fts_parser *parser);
 
 /* The parser is initially called with message body blocks. Once message is
    finished, it's still called with incoming size=0 while the parser increases
    it to non-zero. */
 void fts_parser_more(struct fts_parser *parser, struct message_block *block);
 void fts_parser_deinit(struct fts_parser **parser);
+/* The whole input has been given to fts_parser_more(). If the parser
+   supports it, the conversion runs in the background until the output is
+   read with fts_parser_more(). */
+void fts_parser_input_end(struct fts_parser *parser);
 
 void fts_parsers_unload(void);
 
@@ -179,6 +179,23 @@ static bool fts_args_have_fuzzy(const struct mail_search_arg *args)
 	return FALSE;
 }
 
+static bool
+fts_search_want_scores(const enum mail_sort_type *sort_program,
+		       enum mail_fetch_field wanted_fields)
+{
+	unsigned int i;
+
+	if ((wanted_fields & MAIL_FETCH_SEARCH_RELEVANCY) != 0)
+		return TRUE;
+	if (sort_program == NULL)
+		return FALSE;
+	for (i = 0; sort_program[i] != MAIL_SORT_END; i++) {
+		if ((sort_program[i] & MAIL_SORT_MASK) == MAIL_SORT_RELEVANCY)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 static struct mail_search_context *
 fts_mailbox_search_init(struct mailbox_transaction_context *t,
 			struct mail_search_args *args,
@@ -219,6 +236,8 @@ fts_mailbox_search_init(struct mailbox_transaction_context *t,
 	    mail_user_plugin_getenv(t->box->storage->user,
 				    "fts_no_autofuzzy") != NULL)
 		fctx->flags |= FTS_LOOKUP_FLAG_NO_AUTO_FUZZY;
+	if (fts_search_want_scores(sort_program, wanted_fields))
+		fctx->flags |= FTS_LOOKUP_FLAG_SCORES;
 	/* transaction contains the last search's scores. they can be
 	   queried later with mail_get_special() */
 	if (ft->scores != NULL)